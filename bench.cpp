@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "composer.hpp"
+
+// Counts heap allocations, to show that processing stems allocates nothing
+static long allocations = 0;
+
+void* operator new(std::size_t size) {
+  ++allocations;
+  if (void* memory = std::malloc(size ? size : 1))
+    return memory;
+  throw std::bad_alloc();
+}
+
+// The library's sized and array forms forward to these two
+void operator delete(void* memory) noexcept {
+  std::free(memory);
+}
+
+struct Workload {
+  // Shape of a synthetic catalog and stem stream.
+  int species = 26;
+  int sizes = 2;
+  int designs = 1000;
+  int options = 5;
+  int max_count = 5;
+  long stems = 1'000'000;
+  std::size_t scan_budget = 0;
+  std::string distribution = "uniform";
+  double zipf_exponent = 1.0;
+  std::uint64_t seed = 1;
+  bool emit = false;
+};
+
+Workload parse_workload(int argc, char* argv[]) {
+  // Parses the command line options describing the workload.
+  Workload workload;
+  for (int index = 1; index < argc; ++index) {
+    const std::string_view arg{argv[index]};
+    const bool has_value = index + 1 < argc;
+    if (arg == "--emit") {
+      workload.emit = true;
+    } else if (arg == "--species" && has_value) {
+      workload.species = std::clamp(std::stoi(argv[++index]), 1, 26);
+    } else if (arg == "--sizes" && has_value) {
+      workload.sizes = std::clamp(std::stoi(argv[++index]), 1, 2);
+    } else if (arg == "--designs" && has_value) {
+      workload.designs = std::max(std::stoi(argv[++index]), 1);
+    } else if (arg == "--options" && has_value) {
+      workload.options = std::clamp(std::stoi(argv[++index]), 1, 26);
+    } else if (arg == "--max-count" && has_value) {
+      workload.max_count = std::max(std::stoi(argv[++index]), 1);
+    } else if (arg == "--stems" && has_value) {
+      workload.stems = std::max(std::stol(argv[++index]), 0L);
+    } else if (arg == "--scan-budget" && has_value) {
+      workload.scan_budget = std::max(std::stoi(argv[++index]), 0);
+    } else if (arg == "--distribution" && has_value) {
+      workload.distribution = argv[++index];
+      if (workload.distribution != "uniform" && workload.distribution != "zipf")
+        throw std::invalid_argument("Distribution not one of uniform, zipf");
+    } else if (arg == "--zipf-exponent" && has_value) {
+      workload.zipf_exponent = std::stod(argv[++index]);
+    } else if (arg == "--seed" && has_value) {
+      workload.seed = std::stoull(argv[++index]);
+    } else {
+      auto err_msg = std::string("Unknown or incomplete option: ").append(arg);
+      throw std::invalid_argument(err_msg);
+    }
+  }
+  return workload;
+}
+
+std::vector<std::string> generate_catalog(const Workload& workload,
+                                          std::mt19937_64& random) {
+  // Generates design specifications with uniformly chosen species.
+  std::vector<std::string> catalog;
+  std::vector<char> species(workload.species);
+  std::iota(species.begin(), species.end(), 'a');
+  const int max_options = std::min(workload.options, workload.species);
+  std::uniform_int_distribution<int> code('A', 'Z');
+  std::uniform_int_distribution<int> size(0, workload.sizes - 1);
+  std::uniform_int_distribution<int> options(1, max_options);
+  std::uniform_int_distribution<int> count(1, workload.max_count);
+  for (int index = 0; index < workload.designs; ++index) {
+    std::string spec{char(code(random)), "SL"[size(random)]};
+    const int option_count = options(random);
+    std::shuffle(species.begin(), species.end(), random);
+    int capacity = 0;
+    for (int option = 0; option < option_count; ++option) {
+      const int stem_count = count(random);
+      capacity += stem_count;
+      spec += std::to_string(stem_count) + species[option];
+    }
+    std::uniform_int_distribution<int> total(option_count, capacity);
+    catalog.push_back(spec + std::to_string(total(random)));
+  }
+  return catalog;
+}
+
+std::vector<Stem> generate_stems(const Workload& workload,
+                                 std::mt19937_64& random) {
+  // Generates a stem stream, species drawn uniformly or Zipf distributed.
+  std::vector<double> weights(workload.species, 1.0);
+  if (workload.distribution == "zipf")
+    for (int rank = 0; rank < workload.species; ++rank)
+      weights[rank] = 1.0 / std::pow(rank + 1, workload.zipf_exponent);
+  std::discrete_distribution<int> species(weights.begin(), weights.end());
+  std::uniform_int_distribution<int> size(0, workload.sizes - 1);
+  std::vector<Stem> stems;
+  stems.reserve(workload.stems);
+  for (long index = 0; index < workload.stems; ++index) {
+    const char spec[] = {char('a' + species(random)), "SL"[size(random)]};
+    stems.emplace_back(std::string_view(spec, 2));
+  }
+  return stems;
+}
+
+int main(int argc, char* argv[]) {
+  const auto workload = parse_workload(argc, argv);
+  std::mt19937_64 random{workload.seed};
+  const auto catalog = generate_catalog(workload, random);
+  const auto stems = generate_stems(workload, random);
+  if (workload.emit) {
+    for (const auto& spec : catalog)
+      std::cout << spec << '\n';
+    std::cout << '\n';
+    for (const auto& stem : stems)
+      std::cout << stem << '\n';
+    return 0;
+  }
+
+  using clock = std::chrono::steady_clock;
+  using seconds = std::chrono::duration<double>;
+  const auto catalog_start = clock::now();
+  std::vector<Design> designs;
+  designs.reserve(catalog.size());
+  for (const auto& spec : catalog)
+    designs.emplace_back(spec);
+  Composer composer{designs};
+  composer.add_designs(designs);
+  composer.set_scan_budget(workload.scan_budget);
+  const auto catalog_time = seconds(clock::now() - catalog_start).count();
+
+  // Time every stem individually, the clock reads are part of the total
+  long bouquets = 0;
+  std::vector<std::int64_t> latencies;
+  latencies.reserve(stems.size());
+  const auto stems_start = clock::now();
+  const auto allocations_before = allocations;
+  for (const auto& stem : stems) {
+    const auto start = clock::now();
+    composer.add_stem(stem);
+    bouquets += composer.bouquet_for_stem(stem).has_value();
+    if (composer.has_pending_rechecks())
+      bouquets += composer.recheck().has_value();
+    latencies.push_back((clock::now() - start).count());
+  }
+  const auto stems_time = seconds(clock::now() - stems_start).count();
+  const auto stem_allocations = allocations - allocations_before;
+
+  // Snapshots are saved on the stem path, and restored at startup
+  constexpr int snapshots = 100;
+  std::vector<char> snapshot;
+  const auto save_start = clock::now();
+  for (int index = 0; index < snapshots; ++index)
+    composer.save(snapshot);
+  const auto save_time = seconds(clock::now() - save_start).count();
+  const std::string_view saved{snapshot.data(), snapshot.size()};
+  const auto restore_start = clock::now();
+  for (int index = 0; index < snapshots; ++index)
+    composer.restore(saved);
+  const auto restore_time = seconds(clock::now() - restore_start).count();
+
+  const auto percentile = [&latencies](double fraction) -> std::int64_t {
+    if (latencies.empty())
+      return 0;
+    const auto nth = latencies.begin() + fraction * (latencies.size() - 1);
+    std::nth_element(latencies.begin(), nth, latencies.end());
+    return *nth;
+  };
+  const auto nanoseconds = [](std::int64_t ticks) {
+    return std::chrono::nanoseconds(clock::duration(ticks)).count();
+  };
+  std::cout << "{\"workload\": {\"species\": " << workload.species
+            << ", \"sizes\": " << workload.sizes
+            << ", \"designs\": " << workload.designs
+            << ", \"options\": " << workload.options
+            << ", \"max_count\": " << workload.max_count
+            << ", \"stems\": " << workload.stems
+            << ", \"scan_budget\": " << workload.scan_budget
+            << ", \"distribution\": \"" << workload.distribution << '"'
+            << ", \"zipf_exponent\": " << workload.zipf_exponent
+            << ", \"seed\": " << workload.seed << "}"
+            << ", \"catalog_seconds\": " << catalog_time
+            << ", \"stem_seconds\": " << stems_time
+            << ", \"bouquets\": " << bouquets
+            << ", \"stem_allocations\": " << stem_allocations
+            << ", \"stems_per_second\": " << stems.size() / stems_time
+            << ", \"bouquets_per_second\": " << bouquets / stems_time
+            << ", \"latency_ns\": {\"p50\": " << nanoseconds(percentile(0.5))
+            << ", \"p99\": " << nanoseconds(percentile(0.99))
+            << ", \"max\": " << nanoseconds(percentile(1.0)) << "}"
+            << ", \"snapshot\": {\"bytes\": " << snapshot.size()
+            << ", \"save_ns\": " << save_time / snapshots * 1e9
+            << ", \"restore_ns\": " << restore_time / snapshots * 1e9 << "}}"
+            << std::endl;
+}
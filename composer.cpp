@@ -1,229 +1,443 @@
-#include <compare>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <fstream>
 #include <iostream>
-#include <map>
+#include <iterator>
+#include <limits>
 #include <optional>
-#include <regex>
 #include <stdexcept>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <system_error>
 #include <vector>
 
-class regex_iter_match {
-  // A range-for compatible regular expression iterator.
- public:
-  using iterator = std::regex_iterator<std::string::const_iterator>;
-
-  regex_iter_match(const std::string& s, const std::string& expr)
-      : _expr(expr), _begin(s.begin(), s.end(), _expr), _end() {}
-  regex_iter_match(const std::ssub_match& m, const std::regex& expr)
-      : _expr(expr), _begin(m.first, m.second, _expr), _end() {}
-
-  iterator begin() const { return _begin; }
-  iterator end() const { return _end; }
-
- private:
-  std::regex _expr;
-  iterator _begin;
-  iterator _end;
-};
-
-class Stem {
- public:
-  Stem(const std::string spec) {
-    if (spec.size() != 2)
-      throw std::invalid_argument("Stem constructor takes 2-character string.");
-
-    species = spec[0];
-    size = spec[1];
-    // Invariant checks
-    if (species < 'a' || 'z' < species) {
-      auto err_msg = std::string("Species not in range a-z: ") + spec;
-      throw std::invalid_argument(err_msg);
-    }
-    if (size != 'S' && size != 'L')
-      throw std::invalid_argument(std::string("Size not one of S, L: ") + spec);
+#include "composer.hpp"
+
+void emit_catalog(std::ostream& out, const std::vector<Design>& designs) {
+  // Writes the designs as a C++ header defining static_catalog, for building
+  // a composer with the catalog compiled in (see COMPOSER_CATALOG).
+  out << "// Generated by `composer --emit-catalog`, do not edit.\n";
+  for (std::size_t index = 0; index < designs.size(); ++index) {
+    const auto& design = designs[index];
+    out << "inline constexpr StaticDesign<" << design.stem_counts().size()
+        << "> static_design_" << index << "{\"" << design.code() << "\", "
+        << design.total() << ", {{";
+    for (const auto& option : design.stem_counts())
+      out << "{" << int(option.stem.id()) << ", " << option.count << "}, ";
+    out << "}}};\n";
   }
+  out << "inline constexpr std::array<StaticCatalogEntry, " << designs.size()
+      << "> static_catalog{{\n";
+  for (std::size_t index = 0; index < designs.size(); ++index)
+    out << "    static_entry<static_design_" << index << ">(),\n";
+  out << "}};\n";
+}
 
-  bool operator==(const Stem&) const = default;
-  auto operator<=>(const Stem&) const = default;
-  char get_species() const { return species; }
-
-  friend std::hash<Stem>;
+volatile std::sig_atomic_t stats_requested = 0;
 
- private:
-  char species;
-  char size;
+extern "C" void request_stats(int) { stats_requested = 1; }
 
-  friend std::ostream& operator<<(std::ostream& out, const Stem& stem) {
-    // Output streaming for Stem objects
-    return out << stem.species << stem.size;
-  }
-};
+std::atomic<bool> snapshot_requested{false};
 
-namespace std {
-template <>
-struct std::hash<Stem> {
-  size_t operator()(const Stem& stem) const {
-    return (stem.size << 8) | stem.species;
-  }
-};
-}  // namespace std
+extern "C" void request_snapshot(int) { snapshot_requested = true; }
 
-class StemCount {
- public:
-  const Stem stem;
-  const int count;
-  StemCount(const Stem stem, const int count) : stem(stem), count(count) {}
+void write_stats(std::ostream& out, const ComposerStats& stats,
+                 const LatencyHistogram& latency, const StageTimer& stages) {
+  // Writes the hot path counters, the stem latency histogram and the time
+  // spent in each stage.
+#ifdef COMPOSER_STATS
+  out << stats;
+#else
+  out << "counters not compiled in, build with make composer-stats\n";
+#endif
+  out << latency << stages << std::flush;
+}
 
- private:
-  friend std::ostream& operator<<(std::ostream& out, const StemCount& req) {
-    // Output streaming for StemCount objects
-    return out << req.count << req.stem.get_species();
-  }
+struct Options {
+  bool emit_catalog = false;
+  bool stats = false;
+  bool binary = false;
+  bool async = false;
+  std::size_t batch = 0;
+  BatchOrder batch_order = BatchOrder::arrival;
+  std::chrono::microseconds optimize_budget = Composer::default_budget;
+  OrderingPolicy policy = OrderingPolicy::move_to_front;
+  std::size_t threads = 1;
+  std::size_t scan_budget = 0;
+  std::chrono::milliseconds flush_interval{0};
+  std::optional<std::string> input;
+  std::optional<std::string> compile_catalog;
+  std::optional<std::string> catalog;
+  std::optional<std::string> listen;
+  std::optional<std::string> snapshot;
+  std::chrono::milliseconds snapshot_interval{0};
 };
 
-class Design {
- public:
-  Design(const std::string spec) {
-    std::smatch match;
-    if (!std::regex_match(spec, match, _re_design))
-      throw std::invalid_argument(std::string("Not a valid pattern: ") + spec);
-    const auto stem_size = match[2].str();
-    _total = stoi(match[4]);
-    _code = match[1].str() + stem_size;
-
-    // Determine raw maximums per stem species
-    std::map<Stem, int> raw_stem_counts;
-    for (const auto& stem_match : regex_iter_match(match[3], _re_stems)) {
-      const int stem_count = stoi(stem_match[1]);
-      const char stem_species = stem_match[2].first[0];
-      raw_stem_counts.emplace(stem_species + stem_size, stem_count);
-    }
-
-    // Store bounded maximums per stem in design
-    const int any_stem_max = _total - raw_stem_counts.size() + 1;
-    for (const auto& [stem, count] : raw_stem_counts) {
-      const auto stem_max = std::min(count, any_stem_max);
-      if (stem_max < 1)
-        throw std::invalid_argument("Stem count must be a positive int");
-      _stem_counts.emplace_back(stem, stem_max);
+Options parse_options(int argc, char* argv[]) {
+  // Parses the command line options for the composer.
+  Options options;
+  for (int index = 1; index < argc; ++index) {
+    const std::string_view arg{argv[index]};
+    if (arg == "--emit-catalog") {
+      options.emit_catalog = true;
+    } else if (arg == "--stats") {
+      options.stats = true;
+    } else if (arg == "--binary") {
+      options.binary = true;
+    } else if (arg == "--async") {
+      options.async = true;
+    } else if (arg == "--batch" && index + 1 < argc) {
+      options.batch = std::max(std::stoi(argv[++index]), 0);
+    } else if (arg == "--batch-order" && index + 1 < argc) {
+      const std::string_view order{argv[++index]};
+      if (order == "arrival")
+        options.batch_order = BatchOrder::arrival;
+      else if (order == "deferred")
+        options.batch_order = BatchOrder::deferred;
+      else if (order == "optimized")
+        options.batch_order = BatchOrder::optimized;
+      else
+        throw std::invalid_argument(
+            "Batch order not one of arrival, deferred, optimized");
+    } else if (arg == "--optimize-budget-us" && index + 1 < argc) {
+      const auto microseconds = std::stoi(argv[++index]);
+      options.optimize_budget = std::chrono::microseconds(microseconds);
+    } else if (arg == "--policy" && index + 1 < argc) {
+      const std::string_view policy{argv[++index]};
+      if (policy == "move-to-front")
+        options.policy = OrderingPolicy::move_to_front;
+      else if (policy == "frequency")
+        options.policy = OrderingPolicy::frequency;
+      else if (policy == "most-constrained")
+        options.policy = OrderingPolicy::most_constrained;
+      else if (policy == "static")
+        options.policy = OrderingPolicy::static_order;
+      else
+        throw std::invalid_argument(
+            "Policy not one of move-to-front, frequency, most-constrained, "
+            "static");
+    } else if (arg == "--scan-budget" && index + 1 < argc) {
+      options.scan_budget = std::max(std::stoi(argv[++index]), 0);
+    } else if (arg == "--threads" && index + 1 < argc) {
+      options.threads = std::max(std::stoi(argv[++index]), 1);
+#ifdef COMPOSER_CATALOG
+      if (options.threads > 1)
+        throw std::invalid_argument("No --threads with a compiled-in catalog");
+#endif
+    } else if (arg == "--compile-catalog" && index + 1 < argc) {
+      options.compile_catalog = argv[++index];
+    } else if (arg == "--catalog" && index + 1 < argc) {
+      options.catalog = argv[++index];
+#ifdef COMPOSER_CATALOG
+      throw std::invalid_argument("No --catalog with a compiled-in catalog");
+#endif
+    } else if (arg == "--listen" && index + 1 < argc) {
+      options.listen = argv[++index];
+#ifdef COMPOSER_CATALOG
+      throw std::invalid_argument("No --listen with a compiled-in catalog");
+#endif
+    } else if (arg == "--snapshot" && index + 1 < argc) {
+      options.snapshot = argv[++index];
+    } else if (arg == "--snapshot-interval-ms" && index + 1 < argc) {
+      const auto milliseconds = std::stoi(argv[++index]);
+      options.snapshot_interval = std::chrono::milliseconds(milliseconds);
+    } else if (arg == "--flush-interval-ms" && index + 1 < argc) {
+      const auto milliseconds = std::stoi(argv[++index]);
+      options.flush_interval = std::chrono::milliseconds(milliseconds);
+    } else if (!arg.starts_with("-") && !options.input) {
+      options.input = arg;
+    } else {
+      auto err_msg = std::string("Unknown or incomplete option: ").append(arg);
+      throw std::invalid_argument(err_msg);
     }
   }
+  if (options.snapshot && (options.threads > 1 || options.listen))
+    throw std::invalid_argument("No --snapshot with --threads or --listen");
+  if (options.binary && (options.threads > 1 || options.listen))
+    throw std::invalid_argument("No --binary with --threads or --listen");
+  if (options.scan_budget && (options.threads > 1 || options.listen))
+    throw std::invalid_argument("No --scan-budget with --threads or --listen");
+  // Optimized batches plan over the whole supply rather than scanning
+  if (options.scan_budget && options.batch &&
+      options.batch_order == BatchOrder::optimized)
+    throw std::invalid_argument(
+        "No --scan-budget with --batch-order optimized");
+  if (options.async && (options.threads > 1 || options.listen))
+    throw std::invalid_argument("No --async with --threads or --listen");
+  return options;
+}
 
-  const std::string& code() const { return _code; }
-  const std::vector<StemCount>& stem_counts() const { return _stem_counts; }
-  int total() const { return _total; }
-
- private:
-  std::string _code;
-  std::vector<StemCount> _stem_counts;
-  int _total;
-
-  static const std::regex _re_design;
-  static const std::regex _re_stems;
-
-  friend std::ostream& operator<<(std::ostream& out, const Design& design) {
-    // Output streaming for Design objects
-    out << "Design " << design._code << " with stem options ";
-    for (const auto& req : design._stem_counts)
-      out << req;
-    return out << " and total " << design._total;
+int main(int argc, char* argv[]) {
+  const auto options = parse_options(argc, argv);
+  if (options.listen) {
+    // Serves composers over a socket, --threads sets the number of workers
+    ComposerServer server{*options.listen, options.threads, options.policy};
+    server.run();
   }
-};
-
-const std::regex Design::_re_design{R"(([A-Z])([SL])((?:\d+[a-z])+)(\d+))"};
-const std::regex Design::_re_stems{R"((\d+)([a-z]))"};
-
-class Bouquet {
- public:
-  Bouquet(const std::string& code, std::vector<StemCount> arrangement)
-      : code(code), arrangement(arrangement) {}
-
- private:
-  const std::string& code;
-  std::vector<StemCount> arrangement;
-
-  friend std::ostream& operator<<(std::ostream& out, const Bouquet& bouquet) {
-    // Output streaming and formatting for Bouquet objects
-    out << bouquet.code;
-    for (const auto& spec : bouquet.arrangement)
-      out << spec;
-    return out;
+  int input_fd = STDIN_FILENO;
+  if (options.input && (input_fd = open(options.input->c_str(), O_RDONLY)) < 0)
+    throw std::system_error(errno, std::generic_category(), *options.input);
+  LineReader input{input_fd};
+  // With --stats, time is charged to the stage the composer is in. Stem parse
+  // includes waiting for input, and with --async, for the reader thread.
+  StageTimer stages;
+  const auto enter = [&](StageTimer::Stage stage) {
+    return options.stats ? stages.enter(stage) : stage;
+  };
+
+  // With a compiled-in catalog or catalog image, input has stems only
+  enter(StageTimer::catalog_parse);
+  std::vector<Design> designs;
+  std::optional<CatalogImage> image;
+#ifdef COMPOSER_CATALOG
+  for (const auto& entry : static_catalog)
+    designs.push_back(entry.design());
+#else
+  if (options.catalog)
+    image.emplace(*options.catalog);
+  else
+    designs = parse_designs(input.readparagraph());
+#endif
+  if (image && (options.threads > 1 || options.emit_catalog ||
+                options.compile_catalog))
+    for (DesignId id = 0; id < image->size(); ++id)
+      designs.push_back(image->design(id));
+  if (options.emit_catalog) {
+    emit_catalog(std::cout, designs);
+    return 0;
   }
-};
-
-class Composer {
- public:
-  void add_design(const Design design) noexcept {
-    workspace.reserve(design.stem_counts().size());
-    for (const auto& req : design.stem_counts())
-      designs[req.stem].push_back(design);
+  if (options.compile_catalog) {
+    std::ofstream file{*options.compile_catalog, std::ios::binary};
+    CatalogImage::write(file, designs);
+    if (!file.flush())
+      throw std::runtime_error("Cannot write " + *options.compile_catalog);
+    return 0;
   }
-
-  void add_stem(const Stem& stem) noexcept { supply[stem] += 1; }
-
-  std::optional<Bouquet> bouquet_for_stem(const Stem& stem) noexcept {
-    // Returns an optional Bouquet, created from a Design containing the Stem.
-    // When a bouquet is created, the design it was created from is moved
-    // to the beginning of the designs-for-stem vector.
-    auto& dvec = designs[stem];
-    for (auto design = dvec.begin(); design != dvec.end(); ++design) {
-      if (_select_stems(*design)) {
-        _take_arrangement_from_supply();
-        std::rotate(dvec.begin(), design, design + 1);
-        return Bouquet{design->code(), workspace};
+  // The designs are released once the composer holds them.
+  const auto load_designs = [&](Composer& composer) {
+    if (image)
+      composer.load(*image);
+    composer.add_designs(designs);
+    designs = std::vector<Design>();
+    composer.set_scan_budget(options.scan_budget);
+    enter(StageTimer::other);
+  };
+
+  // Bouquets are flushed one by one on a terminal, and batched otherwise.
+  const bool interactive = isatty(STDOUT_FILENO);
+  OutputBuffer output{STDOUT_FILENO, options.flush_interval};
+  std::ostream out{&output};
+  const auto emit = [&](const auto& bouquet) {
+    // Sharded composers emit formatted text from their own threads, never run
+    // with --binary, and are charged to composition as a whole.
+    const auto guard = output.lock();
+    const auto stage = options.threads > 1 ? StageTimer::composition
+                                           : enter(StageTimer::output);
+    if constexpr (requires(char* record) { bouquet.record_to(record); }) {
+      if (options.binary) {
+        char record[Bouquet::max_record_size];
+        out.write(record, bouquet.record_to(record) - record);
+      } else {
+        out << bouquet << '\n';
       }
+    } else {
+      out << bouquet << '\n';
     }
-    return std::nullopt;
-  }
-
- private:
-  std::vector<StemCount> workspace;
-  std::unordered_map<Stem, int> supply;
-  std::unordered_map<Stem, std::vector<Design>> designs;
-
-  bool _select_stems(const Design& design) noexcept {
-    // Selects stems of design into workspace and returns completion of bouquet.
-    workspace.clear();
-    auto remaining = design.total();
-    auto remaining_options = design.stem_counts().size();
-    for (const auto& option : design.stem_counts()) {
-      if (const auto& available = supply[option.stem]) {
-        const int maximum_take = remaining - (--remaining_options);
-        const auto take = std::min({available, option.count, maximum_take});
-        workspace.emplace_back(option.stem, take);
-        remaining -= take;
-      } else {
-        return false;
+    if (interactive)
+      out.flush();
+    if (options.threads == 1)
+      enter(stage);
+  };
+  // Stems are text lines with design updates in between, or with --binary, a
+  // stream of stem ids of one byte each that runs up to the end of input.
+  const auto read_event = [&](Stem& stem, std::string_view& line) {
+    if (options.binary) {
+      char byte;
+      if (!input.readbyte(byte))
+        return InputEvent::end;
+      const auto id = static_cast<unsigned char>(byte);
+      if (id >= stem_id_count) {
+        auto err_msg = std::string("Stem id not in range 0-51: ");
+        throw std::invalid_argument(err_msg.append(std::to_string(id)));
       }
+      stem = Stem::from_id(id);
+      return InputEvent::stem;
     }
-    return remaining == 0;
+    if (!input.readline(line))
+      return InputEvent::end;
+    if (is_design_update(line))
+      return InputEvent::design_update;
+    stem = Stem{line};
+    return InputEvent::stem;
+  };
+  // With --scan-budget, scans cut short by it continue one step per stem
+  // that follows, and to the end once the input ends.
+  const auto recheck = [&](Composer& composer, std::size_t steps) {
+    for (; steps > 0 && composer.has_pending_rechecks(); --steps)
+      if (auto bouquet = composer.recheck())
+        emit(*bouquet);
+  };
+  constexpr auto all_rechecks = std::numeric_limits<std::size_t>::max();
+  // With --async, stems are read ahead on a thread of their own. Gaps in the
+  // input then run pending re-checks, and resolve partial batches early.
+  std::optional<ReadAhead> ahead;
+  if (options.async)
+    ahead.emplace(read_event);
+  const auto next_event = [&](Stem& stem, std::string_view& line, bool wait) {
+    return ahead ? ahead->next(stem, line, wait) : read_event(stem, line);
+  };
+  // With --snapshot, the composer resumes from the snapshot file if there is
+  // a valid one, starting afresh otherwise, and saves to it periodically, on
+  // SIGUSR2 and at the end of input.
+  std::optional<SnapshotWriter> snapshots;
+  if (options.snapshot) {
+    snapshots.emplace(*options.snapshot, options.snapshot_interval);
+    std::signal(SIGUSR2, request_snapshot);
   }
-
-  void _take_arrangement_from_supply() noexcept {
-    // Removes the stems in the workspace from the supply.
-    for (const auto& spec : workspace)
-      supply[spec.stem] -= spec.count;
-  }
-};
-
-bool readline(std::string& line, std::istream& source = std::cin) noexcept {
-  // Reads a line, signaling the end of a paragraph in addition to EOF.
-  std::getline(source, line);
-  return source && line.size();
-}
-
-int main() {
-  std::ios::sync_with_stdio(false);
-  Composer composer;
-
-  for (std::string line; readline(line);)
-    composer.add_design(line);
-
-  for (std::string line; readline(line);) {
-    const Stem stem{line};
-    composer.add_stem(stem);
-    if (auto bouquet = composer.bouquet_for_stem(stem))
-      std::cout << *bouquet << std::endl;
+  const auto restore_snapshot = [&](Composer& composer) {
+    std::ifstream file{*options.snapshot, std::ios::binary};
+    if (!file)
+      return;
+    try {
+      composer.restore(std::string(std::istreambuf_iterator<char>(file), {}));
+    } catch (const std::runtime_error& e) {
+      std::cerr << "Ignoring snapshot: " << e.what() << '\n';
+    }
+  };
+  const auto save_snapshot = [&](Composer& composer, bool always) {
+    const bool requested =
+        snapshot_requested.load(std::memory_order_relaxed) &&
+        snapshot_requested.exchange(false);
+    if (always || requested || snapshots->due()) {
+      const auto stage = enter(StageTimer::other);
+      composer.save(snapshots->buffer());
+      snapshots->submit();
+      enter(stage);
+    }
+  };
+
+  // With --stats, statistics go to stderr at exit and on SIGUSR1. Sharded
+  // composers only have consistent statistics once they are done, so with
+  // --threads SIGUSR1 is ignored.
+  using clock = std::chrono::steady_clock;
+  LatencyHistogram latency;
+  if (options.stats)
+    std::signal(SIGUSR1, options.threads > 1 ? SIG_IGN : request_stats);
+  const auto report = [&](const ComposerStats& statistics) {
+    enter(StageTimer::other);
+    write_stats(std::cerr, statistics, latency, stages);
+  };
+  enter(StageTimer::index_build);
+  try {
+    if (options.threads > 1) {
+      ShardedComposer composer{designs, options.threads, options.policy};
+      enter(StageTimer::composition);
+      composer.run(input, emit);
+      if (options.stats)
+        report(composer.statistics());
+    } else if (options.batch > 0) {
+      // Batches are resolved as a whole, latency is not measured per stem
+      auto composer = image ? Composer{*image, options.policy}
+                            : Composer{designs, options.policy};
+      load_designs(composer);
+      if (snapshots)
+        restore_snapshot(composer);
+      std::vector<Stem> batch;
+      batch.reserve(options.batch);
+      const auto wait = [&] {
+        return batch.empty() && !composer.has_pending_rechecks();
+      };
+      for (auto event = InputEvent::stem; event != InputEvent::end;) {
+        // A design update or gap in the input ends the batch, and an update
+        // applies once the batch is resolved
+        batch.clear();
+        Stem stem = Stem::from_id(0);
+        std::string_view line;
+        enter(StageTimer::stem_parse);
+        while (batch.size() < options.batch &&
+               (event = next_event(stem, line, wait())) == InputEvent::stem)
+          batch.push_back(stem);
+        enter(StageTimer::composition);
+        composer.add_stems(batch, options.batch_order, emit,
+                           options.optimize_budget);
+        recheck(composer, event == InputEvent::end
+                              ? all_rechecks
+                              : std::max<std::size_t>(batch.size(), 1));
+        if (event == InputEvent::design_update) {
+          enter(StageTimer::index_build);
+          apply_design_update(composer, line);
+        }
+        if (options.stats && stats_requested) {
+          stats_requested = 0;
+          report(composer.statistics());
+        }
+        if (snapshots)
+          save_snapshot(composer, event == InputEvent::end);
+      }
+      if (options.stats)
+        report(composer.statistics());
+    } else {
+      auto composer = image ? Composer{*image, options.policy}
+                            : Composer{designs, options.policy};
+      load_designs(composer);
+      if (snapshots)
+        restore_snapshot(composer);
+      Stem stem = Stem::from_id(0);
+      std::string_view line;
+      const auto next = [&] {
+        return next_event(stem, line, !composer.has_pending_rechecks());
+      };
+      // Stage switches around each stem reuse the latency clock reads
+      enter(StageTimer::stem_parse);
+      for (InputEvent event; (event = next()) != InputEvent::end;) {
+        if (event == InputEvent::idle) {
+          enter(StageTimer::composition);
+          recheck(composer, 1);
+          enter(StageTimer::stem_parse);
+          continue;
+        }
+        if (event == InputEvent::design_update) {
+          enter(StageTimer::index_build);
+          apply_design_update(composer, line);
+          enter(StageTimer::stem_parse);
+          continue;
+        }
+        const auto start = options.stats ? clock::now() : clock::time_point{};
+        if (options.stats)
+          stages.enter(StageTimer::composition, start);
+        composer.add_stem(stem);
+        if (auto bouquet = composer.bouquet_for_stem(stem))
+          emit(*bouquet);
+        recheck(composer, 1);
+        if (options.stats) {
+          const auto end = clock::now();
+          latency.record(end - start);
+          stages.enter(StageTimer::stem_parse, end);
+          if (stats_requested) {
+            stats_requested = 0;
+            report(composer.statistics());
+            enter(StageTimer::stem_parse);
+          }
+        }
+        if (snapshots)
+          save_snapshot(composer, false);
+      }
+      enter(StageTimer::composition);
+      recheck(composer, all_rechecks);
+      if (snapshots)
+        save_snapshot(composer, true);
+      if (options.stats)
+        report(composer.statistics());
+    }
+  } catch (...) {
+    const auto guard = output.lock();
+    out.flush();
+    throw;
   }
 }
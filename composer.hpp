@@ -0,0 +1,2822 @@
+#pragma once
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <compare>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Stems are one of 26 species in one of two sizes, which allows a dense index.
+using StemId = std::uint8_t;
+constexpr std::size_t stem_id_count = 2 * 26;
+
+class Stem {
+ public:
+  Stem(const std::string_view spec) {
+    if (spec.size() != 2)
+      throw std::invalid_argument("Stem constructor takes 2-character string.");
+
+    species = spec[0];
+    size = spec[1];
+    // Invariant checks
+    if (species < 'a' || 'z' < species) {
+      auto err_msg = std::string("Species not in range a-z: ").append(spec);
+      throw std::invalid_argument(err_msg);
+    }
+    if (size != 'S' && size != 'L') {
+      auto err_msg = std::string("Size not one of S, L: ").append(spec);
+      throw std::invalid_argument(err_msg);
+    }
+  }
+
+  bool operator==(const Stem&) const = default;
+  auto operator<=>(const Stem&) const = default;
+  char get_species() const { return species; }
+  StemId id() const noexcept {
+    // Dense index for the stem: small stems in 0..25, large ones in 26..51.
+    return (size == 'L') * 26 + (species - 'a');
+  }
+  static constexpr Stem from_id(StemId id) noexcept {
+    return Stem('a' + id % 26, id < 26 ? 'S' : 'L');
+  }
+
+  friend std::hash<Stem>;
+
+ private:
+  char species;
+  char size;
+
+  constexpr Stem(char species, char size) : species(species), size(size) {}
+
+  friend std::ostream& operator<<(std::ostream& out, const Stem& stem) {
+    // Output streaming for Stem objects
+    return out << stem.species << stem.size;
+  }
+};
+
+namespace std {
+template <>
+struct hash<Stem> {
+  size_t operator()(const Stem& stem) const {
+    return (stem.size << 8) | stem.species;
+  }
+};
+}  // namespace std
+
+class StemCount {
+ public:
+  Stem stem = Stem::from_id(0);
+  int count = 0;
+  StemCount() = default;
+  StemCount(const Stem stem, const int count) : stem(stem), count(count) {}
+
+  bool operator==(const StemCount&) const = default;
+
+ private:
+  friend std::ostream& operator<<(std::ostream& out, const StemCount& req) {
+    // Output streaming for StemCount objects
+    return out << req.count << req.stem.get_species();
+  }
+};
+
+// Design codes are an uppercase letter and a stem size, packed in 16 bits.
+class DesignCode {
+ public:
+  constexpr DesignCode(char letter, char size) noexcept
+      : packed(std::uint16_t(letter << 8 | size)) {}
+
+  bool operator==(const DesignCode&) const = default;
+  constexpr std::array<char, 2> format() const noexcept {
+    return {char(packed >> 8), char(packed & 0xff)};
+  }
+
+ private:
+  std::uint16_t packed;
+
+  friend std::ostream& operator<<(std::ostream& out, const DesignCode& code) {
+    // Output streaming for DesignCode objects
+    const auto chars = code.format();
+    return out.write(chars.data(), chars.size());
+  }
+};
+
+class Design {
+  // Designs are trivially copyable, their options are held inline as there
+  // is at most one per species.
+ public:
+  static constexpr std::size_t max_options = 26;
+
+  Design(const std::string_view spec) : _code(_parse_code(spec)) {
+    // Single pass parser for the pattern ([A-Z])([SL])((?:\d+[a-z])+)(\d+)
+    const auto invalid = [spec] {
+      auto err_msg = std::string("Not a valid pattern: ").append(spec);
+      return std::invalid_argument(err_msg);
+    };
+    if (spec.size() < 5)
+      throw invalid();
+    const char stem_size = spec[1];
+
+    // Determine raw maximums per stem species, the first mention counts
+    std::array<int, 26> raw_stem_counts;
+    raw_stem_counts.fill(-1);
+    std::size_t species_count = 0;
+    const char* pos = spec.data() + 2;
+    const char* const end = spec.data() + spec.size();
+    while (true) {
+      const int number = _parse_number(pos, end, invalid);
+      if (pos == end) {
+        _total = number;
+        break;
+      }
+      if (*pos < 'a' || 'z' < *pos)
+        throw invalid();
+      if (auto& count = raw_stem_counts[*pos++ - 'a']; count < 0) {
+        count = number;
+        ++species_count;
+      }
+    }
+    if (species_count == 0)
+      throw invalid();
+
+    // Store bounded maximums per stem in design
+    const int any_stem_max = _total - species_count + 1;
+    for (char species = 'a'; species <= 'z'; ++species) {
+      const auto count = raw_stem_counts[species - 'a'];
+      if (count < 0)
+        continue;
+      const auto stem_max = std::min(count, any_stem_max);
+      if (stem_max < 1)
+        throw std::invalid_argument("Stem count must be a positive int");
+      const char stem[] = {species, stem_size};
+      _stem_counts[_options++] = {std::string_view(stem, 2), stem_max};
+    }
+  }
+
+  Design(DesignCode code, std::span<const StemCount> stem_counts, int total)
+      : _code(code), _options(stem_counts.size()), _total(total) {
+    std::copy(stem_counts.begin(), stem_counts.end(), _stem_counts.begin());
+  }
+
+  bool operator==(const Design&) const = default;
+
+  DesignCode code() const { return _code; }
+  std::span<const StemCount> stem_counts() const {
+    return {_stem_counts.data(), _options};
+  }
+  int total() const { return _total; }
+
+ private:
+  DesignCode _code;
+  std::uint8_t _options = 0;
+  int _total;
+  std::array<StemCount, max_options> _stem_counts;
+
+  static DesignCode _parse_code(std::string_view spec) {
+    // Parses the design code, the leading ([A-Z])([SL]) of the pattern.
+    if (spec.size() < 2 || spec[0] < 'A' || 'Z' < spec[0] ||
+        (spec[1] != 'S' && spec[1] != 'L')) {
+      auto err_msg = std::string("Not a valid pattern: ").append(spec);
+      throw std::invalid_argument(err_msg);
+    }
+    return {spec[0], spec[1]};
+  }
+
+  template <typename Error>
+  static int _parse_number(const char*& pos, const char* end, Error invalid) {
+    // Parses the run of digits at pos and advances pos past it.
+    if (pos == end || *pos < '0' || '9' < *pos)
+      throw invalid();
+    int number = 0;
+    const auto [next, ec] = std::from_chars(pos, end, number);
+    if (ec == std::errc::result_out_of_range)
+      throw std::out_of_range("Number in pattern out of range");
+    pos = next;
+    return number;
+  }
+
+  friend std::ostream& operator<<(std::ostream& out, const Design& design) {
+    // Output streaming for Design objects
+    out << "Design " << design._code << " with stem options ";
+    for (const auto& req : design.stem_counts())
+      out << req;
+    return out << " and total " << design._total;
+  }
+};
+static_assert(std::is_trivially_copyable_v<Design>);
+
+// Catalog images and snapshots hold designs in native byte order, marked by
+// byte_order_mark, as records of their code and total followed by one
+// OptionRecord per option.
+constexpr std::uint32_t byte_order_mark = 0x01020304;
+
+struct OptionRecord {
+  StemId stem;
+  std::uint8_t reserved[3];
+  std::int32_t count;
+};
+
+template <typename Error>
+std::uint64_t check_design_record(const char (&code)[2], int total,
+                                  std::span<const OptionRecord> options,
+                                  Error invalid) {
+  // Checks that a design read from a binary file is one that parsing its
+  // pattern could give, and returns its mask of stems.
+  if (code[0] < 'A' || 'Z' < code[0] || (code[1] != 'S' && code[1] != 'L'))
+    throw invalid("design code out of range");
+  if (options.empty() || options.size() > Design::max_options ||
+      total < int(options.size()))
+    throw invalid("design options out of range");
+  std::uint64_t mask = 0;
+  for (const auto& option : options) {
+    if (option.stem >= stem_id_count || option.count < 1 ||
+        option.stem / 26 != (code[1] == 'L') || mask >> option.stem & 1)
+      throw invalid("design option out of range");
+    mask |= std::uint64_t(1) << option.stem;
+  }
+  return mask;
+}
+
+template <typename Option>
+Design design_from_records(DesignCode code, std::span<const Option> options,
+                           int total) {
+  // Builds a design from records of its options' stem ids and bounded
+  // maximum counts, read from a binary file or compiled in.
+  std::array<StemCount, Design::max_options> stem_counts;
+  for (std::size_t index = 0; index < options.size(); ++index)
+    stem_counts[index] = {Stem::from_id(options[index].stem),
+                          options[index].count};
+  return {code, {stem_counts.data(), options.size()}, total};
+}
+
+// Designs from a catalog compiled into the binary. The generated catalog
+// header defines static_catalog, an array of StaticCatalogEntry in catalog
+// order; each entry carries a selection function unrolled for its design.
+struct StaticOption {
+  StemId stem;
+  int count;
+};
+
+template <std::size_t N>
+struct StaticDesign {
+  std::string_view code;
+  int total;
+  std::array<StaticOption, N> options;
+};
+
+using StaticSelector =
+    bool (*)(const std::array<int, stem_id_count>& supply,
+             std::pmr::vector<StemCount>& workspace) noexcept;
+
+struct StaticCatalogEntry {
+  std::string_view code;
+  int total;
+  std::span<const StaticOption> options;
+  StaticSelector select;
+
+  Design design() const {
+    return design_from_records({code[0], code[1]}, options, total);
+  }
+};
+
+template <const auto& design>
+bool select_static_stems(const std::array<int, stem_id_count>& supply,
+                         std::pmr::vector<StemCount>& workspace) noexcept {
+  // Composer::_select_stems, unrolled over the design's fixed options.
+  constexpr std::size_t options = design.options.size();
+  workspace.clear();
+  int remaining = design.total;
+  const auto select = [&]<std::size_t index>() {
+    constexpr auto option = design.options[index];
+    const int available = supply[option.stem];
+    if (!available)
+      return false;
+    const int maximum_take = remaining - int(options - index - 1);
+    const auto take = std::min({available, option.count, maximum_take});
+    workspace.emplace_back(Stem::from_id(option.stem), take);
+    remaining -= take;
+    return true;
+  };
+  return [&]<std::size_t... index>(std::index_sequence<index...>) {
+    return (select.template operator()<index>() && ...) && remaining == 0;
+  }(std::make_index_sequence<options>{});
+}
+
+template <const auto& design>
+constexpr StaticCatalogEntry static_entry() {
+  return {design.code, design.total, design.options,
+          &select_static_stems<design>};
+}
+
+#ifdef COMPOSER_CATALOG
+#include COMPOSER_CATALOG
+#endif
+
+// Designs are stored once in the composer's catalog and referred to by index.
+using DesignId = std::uint32_t;
+
+class Bouquet {
+  // A view of a composed bouquet. It refers to the design's code and to the
+  // composer's workspace, and is only valid until the composer is next used.
+ public:
+  Bouquet(DesignId design, DesignCode code,
+          std::span<const StemCount> arrangement)
+      : design(design), code(code), arrangement(arrangement) {}
+
+  static constexpr std::size_t max_size =
+      2 + 26 * (std::numeric_limits<int>::digits10 + 2);
+
+  // Binary form of a bouquet, in native byte order and unaligned: the id of
+  // its design in catalog order as a uint32_t, the number of species taken
+  // as a byte, then per species its index in a-z as a byte and the number
+  // of stems taken as a uint32_t.
+  static constexpr std::size_t max_record_size = 4 + 1 + 26 * (1 + 4);
+
+  char* record_to(char* out) const noexcept {
+    // Writes the bouquet's binary record, out must fit max_record_size bytes.
+    const auto put = [&out](auto value) {
+      out = static_cast<char*>(std::memcpy(out, &value, sizeof(value))) +
+            sizeof(value);
+    };
+    put(std::uint32_t(design));
+    put(std::uint8_t(arrangement.size()));
+    for (const auto& spec : arrangement) {
+      put(std::uint8_t(spec.stem.get_species() - 'a'));
+      put(std::uint32_t(spec.count));
+    }
+    return out;
+  }
+
+  char* format_to(char* out) const noexcept {
+    // Formats the bouquet like operator<<, out must fit max_size characters.
+    const auto chars = code.format();
+    out = std::copy(chars.begin(), chars.end(), out);
+    for (const auto& spec : arrangement) {
+      out = std::to_chars(out, out + max_size, spec.count).ptr;
+      *out++ = spec.stem.get_species();
+    }
+    return out;
+  }
+
+ private:
+  DesignId design;
+  DesignCode code;
+  std::span<const StemCount> arrangement;
+
+  friend std::ostream& operator<<(std::ostream& out, const Bouquet& bouquet) {
+    // Output streaming and formatting for Bouquet objects
+    out << bouquet.code;
+    for (const auto& spec : bouquet.arrangement)
+      out << spec;
+    return out;
+  }
+};
+
+class CatalogImage {
+  // A pre-parsed design catalog in a versioned binary file, memory mapped
+  // read-only. The file holds, in native byte order and sections of
+  // decreasing alignment:
+  //   Header         magic, version, byte order mark and element counts
+  //   Posting        postings: per stem, ids of the designs using it in
+  //                  catalog order, each with the design's mask of stems
+  //   DesignRecord   per design: code, total and its range of options
+  //   OptionRecord   per design option: stem id and bounded maximum count
+  //   uint32_t       stem_id_count + 1 offsets into the postings
+ public:
+  static constexpr std::uint32_t version = 2;
+
+  struct Posting {
+    DesignId id;
+    std::uint32_t reserved;
+    std::uint64_t mask;
+  };
+
+  explicit CatalogImage(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::system_error(errno, std::generic_category(), path);
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+      void* map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+        mapping = {static_cast<const char*>(map), std::size_t(info.st_size)};
+    }
+    close(fd);
+    if (mapping.empty())
+      throw std::runtime_error("Cannot map catalog image: " + path);
+    try {
+      _validate();
+    } catch (...) {
+      munmap(const_cast<char*>(mapping.data()), mapping.size());
+      throw;
+    }
+  }
+  CatalogImage(const CatalogImage&) = delete;
+  CatalogImage& operator=(const CatalogImage&) = delete;
+  ~CatalogImage() { munmap(const_cast<char*>(mapping.data()), mapping.size()); }
+
+  std::size_t size() const noexcept { return header->designs; }
+  std::size_t option_count(DesignId id) const noexcept {
+    return designs[id].options;
+  }
+  DesignCode code(DesignId id) const noexcept {
+    return {designs[id].code[0], designs[id].code[1]};
+  }
+  int total(DesignId id) const noexcept { return designs[id].total; }
+  std::span<const OptionRecord> options(DesignId id) const noexcept {
+    return {options_begin + designs[id].first_option, designs[id].options};
+  }
+  std::span<const Posting> postings(StemId stem) const noexcept {
+    return {postings_begin + offsets[stem], postings_begin + offsets[stem + 1]};
+  }
+  Design design(DesignId id) const {
+    return design_from_records(code(id), options(id), total(id));
+  }
+
+  static void write(std::ostream& out, const std::vector<Design>& catalog) {
+    // Writes the designs and their per-stem index as a catalog image.
+    Header head{{'C', 'A', 'R', 'R', 'C', 'A', 'T', '\0'}, version,
+                byte_order_mark, std::uint32_t(catalog.size()), 0, 0, 0};
+    std::vector<DesignRecord> design_records;
+    std::vector<OptionRecord> option_records;
+    std::array<std::vector<Posting>, stem_id_count> index;
+    for (DesignId id = 0; id < catalog.size(); ++id) {
+      const auto& design = catalog[id];
+      const auto code = design.code().format();
+      DesignRecord record{{code[0], code[1]},
+                          std::uint8_t(design.stem_counts().size()),
+                          0,
+                          design.total(),
+                          std::uint32_t(option_records.size())};
+      design_records.push_back(record);
+      std::uint64_t mask = 0;
+      for (const auto& option : design.stem_counts())
+        mask |= std::uint64_t(1) << option.stem.id();
+      for (const auto& option : design.stem_counts()) {
+        option_records.push_back({option.stem.id(), {}, option.count});
+        index[option.stem.id()].push_back({id, 0, mask});
+      }
+    }
+    head.options = head.postings = option_records.size();
+    std::array<std::uint32_t, stem_id_count + 1> offsets{};
+    for (std::size_t stem = 0; stem < stem_id_count; ++stem)
+      offsets[stem + 1] = offsets[stem] + index[stem].size();
+
+    const auto put = [&out](const auto* data, std::size_t count) {
+      out.write(reinterpret_cast<const char*>(data), sizeof(*data) * count);
+    };
+    put(&head, 1);
+    for (const auto& postings : index)
+      put(postings.data(), postings.size());
+    put(design_records.data(), design_records.size());
+    put(option_records.data(), option_records.size());
+    put(offsets.data(), offsets.size());
+  }
+
+ private:
+  struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint32_t designs;
+    std::uint32_t options;
+    std::uint32_t postings;
+    std::uint32_t reserved;
+  };
+  struct DesignRecord {
+    char code[2];
+    std::uint8_t options;
+    std::uint8_t reserved;
+    std::int32_t total;
+    std::uint32_t first_option;
+  };
+
+  std::string_view mapping;
+  const Header* header = nullptr;
+  const DesignRecord* designs = nullptr;
+  const OptionRecord* options_begin = nullptr;
+  const std::uint32_t* offsets = nullptr;
+  const Posting* postings_begin = nullptr;
+
+  void _validate() {
+    // Checks that the image is complete and consistent before it is used.
+    const auto invalid = [](const char* reason) {
+      auto err_msg = std::string("Invalid catalog image: ").append(reason);
+      return std::runtime_error(err_msg);
+    };
+    if (mapping.size() < sizeof(Header))
+      throw invalid("truncated header");
+    header = reinterpret_cast<const Header*>(mapping.data());
+    if (std::string_view(header->magic, 8) != std::string_view("CARRCAT", 8))
+      throw invalid("not a catalog image");
+    if (header->version != version || header->byte_order != byte_order_mark)
+      throw invalid("unsupported version or byte order");
+    const std::size_t expected =
+        sizeof(Header) + header->postings * sizeof(Posting) +
+        header->designs * sizeof(DesignRecord) +
+        header->options * sizeof(OptionRecord) +
+        (stem_id_count + 1) * sizeof(std::uint32_t);
+    if (mapping.size() != expected || header->postings != header->options)
+      throw invalid("size does not match contents");
+    postings_begin = reinterpret_cast<const Posting*>(header + 1);
+    designs = reinterpret_cast<const DesignRecord*>(postings_begin +
+                                                    header->postings);
+    options_begin =
+        reinterpret_cast<const OptionRecord*>(designs + header->designs);
+    offsets =
+        reinterpret_cast<const std::uint32_t*>(options_begin + header->options);
+
+    if (offsets[0] != 0 || offsets[stem_id_count] != header->postings)
+      throw invalid("index offsets out of range");
+    for (StemId stem = 0; stem < stem_id_count; ++stem)
+      if (offsets[stem] > offsets[stem + 1])
+        throw invalid("index offsets out of order");
+
+    // Designs' options are laid out one range after another, and each stem's
+    // postings list the designs using it in catalog order, which is checked
+    // by walking the designs with a cursor into the postings of each stem
+    std::array<std::uint32_t, stem_id_count> next;
+    std::copy(offsets, offsets + stem_id_count, next.begin());
+    std::uint32_t option_count = 0;
+    for (DesignId id = 0; id < header->designs; ++id) {
+      const auto& record = designs[id];
+      if (record.first_option != option_count ||
+          record.options > header->options - option_count)
+        throw invalid("design options out of range");
+      option_count += record.options;
+      const auto specs = options(id);
+      const auto mask =
+          check_design_record(record.code, record.total, specs, invalid);
+      for (const auto& option : specs) {
+        auto& position = next[option.stem];
+        if (position == offsets[option.stem + 1] ||
+            postings_begin[position].id != id ||
+            postings_begin[position++].mask != mask)
+          throw invalid("index does not match the designs");
+      }
+    }
+    // With as many postings as options, all of them were walked
+    if (option_count != header->options)
+      throw invalid("design options out of range");
+  }
+};
+
+// Hot path counters are only maintained in builds defining COMPOSER_STATS.
+#ifdef COMPOSER_STATS
+#define COMPOSER_COUNT(statement) statement
+#else
+#define COMPOSER_COUNT(statement)
+#endif
+
+struct ComposerStats {
+  std::uint64_t calls = 0;            // bouquet_for_stem() calls
+  std::uint64_t budget_cuts = 0;      // Scans cut short by the budget
+  std::uint64_t rechecks = 0;         // Scans continued by recheck()
+  std::uint64_t designs_scanned = 0;  // Designs considered in those calls
+  std::uint64_t mask_rejects = 0;     // Rejected by the stocked stems mask
+  std::uint64_t selections = 0;       // Full _select_stems() evaluations
+  std::uint64_t bouquets = 0;
+  std::uint64_t rotate_distance = 0;  // Positions moved forward
+  std::uint64_t max_rotate_distance = 0;
+  std::uint64_t supply = 0;  // Stems currently in supply
+  std::uint64_t max_supply = 0;
+
+  ComposerStats& operator+=(const ComposerStats& other) noexcept {
+    calls += other.calls;
+    budget_cuts += other.budget_cuts;
+    rechecks += other.rechecks;
+    designs_scanned += other.designs_scanned;
+    mask_rejects += other.mask_rejects;
+    selections += other.selections;
+    bouquets += other.bouquets;
+    rotate_distance += other.rotate_distance;
+    max_rotate_distance =
+        std::max(max_rotate_distance, other.max_rotate_distance);
+    supply += other.supply;
+    max_supply += other.max_supply;
+    return *this;
+  }
+
+ private:
+  friend std::ostream& operator<<(std::ostream& out,
+                                  const ComposerStats& stats) {
+    // Output streaming for ComposerStats, one counter per line
+    const auto ratio = [](double part, double whole) {
+      return whole ? part / whole : 0.0;
+    };
+    return out << "calls " << stats.calls << '\n'
+               << "budget_cuts " << stats.budget_cuts << '\n'
+               << "rechecks " << stats.rechecks << '\n'
+               << "designs_scanned " << stats.designs_scanned << '\n'
+               << "designs_per_call "
+               << ratio(stats.designs_scanned, stats.calls) << '\n'
+               << "mask_rejects " << stats.mask_rejects << '\n'
+               << "selections " << stats.selections << '\n'
+               << "bouquets " << stats.bouquets << '\n'
+               << "rotate_distance_mean "
+               << ratio(stats.rotate_distance, stats.bouquets) << '\n'
+               << "rotate_distance_max " << stats.max_rotate_distance << '\n'
+               << "supply " << stats.supply << '\n'
+               << "supply_max " << stats.max_supply << '\n';
+  }
+};
+
+class LatencyHistogram {
+  // Latency distribution in power-of-two nanosecond buckets.
+ public:
+  void record(std::chrono::nanoseconds latency) noexcept {
+    ++buckets[std::bit_width(std::uint64_t(latency.count()))];
+    ++samples;
+  }
+
+  std::uint64_t percentile(double fraction) const noexcept {
+    // Returns the upper bound in nanoseconds of the bucket with the quantile.
+    std::uint64_t seen = 0;
+    for (std::size_t bucket = 0; bucket < buckets.size(); ++bucket)
+      if ((seen += buckets[bucket]) > fraction * samples)
+        return (std::uint64_t(1) << bucket) - 1;
+    return 0;
+  }
+
+ private:
+  std::array<std::uint64_t, 65> buckets{};
+  std::uint64_t samples = 0;
+
+  friend std::ostream& operator<<(std::ostream& out,
+                                  const LatencyHistogram& histogram) {
+    // Output streaming for LatencyHistogram, nonempty buckets and quantiles
+    out << "latency_samples " << histogram.samples << '\n'
+        << "latency_p50_ns " << histogram.percentile(0.5) << '\n'
+        << "latency_p99_ns " << histogram.percentile(0.99) << '\n';
+    for (std::size_t bucket = 0; bucket < histogram.buckets.size(); ++bucket)
+      if (const auto count = histogram.buckets[bucket])
+        out << "latency_lt_" << (std::uint64_t(1) << bucket) << "ns " << count
+            << '\n';
+    return out;
+  }
+};
+
+class StageTimer {
+  // Wall time per processing stage, charged by switching between stages so
+  // that nested stages (output while composing) are not counted twice.
+ public:
+  using clock = std::chrono::steady_clock;
+  enum Stage : std::uint8_t {
+    other,
+    catalog_parse,
+    index_build,
+    stem_parse,
+    composition,
+    output,
+  };
+
+  Stage enter(Stage stage, clock::time_point now = clock::now()) noexcept {
+    // Charges the time up to now to the current stage, switches to the given
+    // one, and returns the stage it left.
+    elapsed[current] += now - since;
+    since = now;
+    return std::exchange(current, stage);
+  }
+
+ private:
+  static constexpr std::array<std::string_view, 6> names{
+      "other", "catalog_parse", "index_build", "stem_parse", "composition",
+      "output"};
+  std::array<clock::duration, names.size()> elapsed{};
+  clock::time_point since = clock::now();
+  Stage current = other;
+
+  friend std::ostream& operator<<(std::ostream& out, const StageTimer& timer) {
+    // Output streaming for StageTimer, the time charged to each stage
+    for (std::size_t stage = 0; stage < names.size(); ++stage) {
+      const auto time = std::chrono::nanoseconds(timer.elapsed[stage]);
+      out << "stage_" << names[stage] << "_ns " << time.count() << '\n';
+    }
+    return out;
+  }
+};
+
+// Designs' options are also kept as structure-of-arrays lanes: stem ids and
+// maximum counts, padded per design to a multiple of option_lanes.
+constexpr std::size_t option_lanes = 8;
+static_assert(sizeof(int) == sizeof(std::int32_t));
+
+inline void cap_options(const std::int32_t* supply, const std::int32_t* stems,
+                        const std::int32_t* counts, std::int32_t* capped,
+                        std::size_t lanes) noexcept {
+  // Computes capped[i] = min(supply[stems[i]], counts[i]) over whole lanes,
+  // vectorized with AVX2 or NEON where available.
+#if defined(__AVX2__)
+  for (std::size_t lane = 0; lane < lanes; lane += 8) {
+    const auto index = _mm256_loadu_si256((const __m256i*)(stems + lane));
+    const auto available = _mm256_i32gather_epi32(supply, index, 4);
+    const auto maximum = _mm256_loadu_si256((const __m256i*)(counts + lane));
+    _mm256_storeu_si256((__m256i*)(capped + lane),
+                        _mm256_min_epi32(available, maximum));
+  }
+#elif defined(__ARM_NEON)
+  for (std::size_t lane = 0; lane < lanes; lane += 4) {
+    const std::int32_t gathered[] = {
+        supply[stems[lane]], supply[stems[lane + 1]], supply[stems[lane + 2]],
+        supply[stems[lane + 3]]};
+    vst1q_s32(capped + lane,
+              vminq_s32(vld1q_s32(gathered), vld1q_s32(counts + lane)));
+  }
+#else
+  for (std::size_t lane = 0; lane < lanes; ++lane)
+    capped[lane] = std::min(supply[stems[lane]], counts[lane]);
+#endif
+}
+
+// Resolution order for a batch of stems passed to Composer::add_stems:
+//   arrival   Each stem is added and resolved in turn, exactly as calling
+//             add_stem and bouquet_for_stem per stem would.
+//   deferred  The whole batch is added to the supply first. Then each
+//             distinct stem in the batch, in order of first arrival, yields
+//             bouquets until none of its designs can be completed.
+//   optimized Bouquets are planned to maximize their number, starting from
+//             those of arrival order and improving on them within a time
+//             budget, with the whole batch in supply. Unless a better plan
+//             is found, the result is that of arrival order.
+enum class BatchOrder { arrival, deferred, optimized };
+
+// Order in which the designs for a stem are tried, and how it changes:
+//   move_to_front     A design that yields a bouquet moves to the front.
+//   frequency         A design that yields a bouquet moves ahead of the
+//                     designs that yielded fewer bouquets.
+//   most_constrained  Designs with the least spare capacity over their total
+//                     come first, and the order does not change.
+//   static_order      Designs are tried in catalog order, which never changes.
+enum class OrderingPolicy {
+  move_to_front,
+  frequency,
+  most_constrained,
+  static_order
+};
+
+// Catalogs are loaded in chunks of at least min_load_chunk designs, spread
+// over the hardware threads.
+constexpr std::size_t min_load_chunk = 1 << 12;
+
+inline std::size_t load_chunks(std::size_t designs) noexcept {
+  const std::size_t threads = std::thread::hardware_concurrency();
+  return std::clamp<std::size_t>(designs / min_load_chunk, 1,
+                                 std::max<std::size_t>(threads, 1));
+}
+
+template <typename Work>
+void run_chunks(std::size_t chunks, Work work) {
+  // Calls work(chunk) for every chunk, all but the first on their own thread,
+  // and rethrows the exception of the first chunk that failed, if any.
+  std::vector<std::exception_ptr> errors(chunks);
+  const auto run = [&](std::size_t chunk) noexcept {
+    try {
+      work(chunk);
+    } catch (...) {
+      errors[chunk] = std::current_exception();
+    }
+  };
+  {
+    std::vector<std::jthread> threads;
+    for (std::size_t chunk = 1; chunk < chunks; ++chunk)
+      threads.emplace_back(run, chunk);
+    run(0);
+  }
+  for (const auto& error : errors)
+    if (error)
+      std::rethrow_exception(error);
+}
+
+class Composer {
+  // All of the composer's containers allocate from a monotonic arena owned
+  // by the composer. Constructed with the designs or catalog image about to
+  // be added, the arena is sized and the containers reserved for them, so
+  // that adding those designs takes few allocations and processing stems
+  // takes none.
+ public:
+  explicit Composer(std::span<const Design> upcoming = {},
+                    OrderingPolicy policy = OrderingPolicy::move_to_front)
+      : Composer(CatalogShape(upcoming), policy) {}
+  explicit Composer(const CatalogImage& upcoming,
+                    OrderingPolicy policy = OrderingPolicy::move_to_front)
+      : Composer(CatalogShape(upcoming), policy) {}
+  Composer(const Composer&) = delete;
+  Composer& operator=(const Composer&) = delete;
+
+  void add_design(Design design) noexcept {
+    const auto mask = _mask(design.stem_counts());
+    const auto id = _store_design(design);
+    for (const auto& req : _stem_counts(id))
+      _insert_candidate(req.stem.id(), {id, mask});
+  }
+
+  void add_designs(std::span<const Design> batch) {
+    // Adds the designs as add_design() would one by one. Their part of the
+    // per-stem index is built by a counting sort over chunks of the designs,
+    // which fills each stem's candidates in catalog order.
+    const DesignId first = catalog.size();
+    for (const auto& design : batch)
+      loaded = _fingerprint(loaded, _store_design(design));
+    const auto chunks = load_chunks(batch.size());
+    const auto chunk_begin = [&](std::size_t chunk) -> DesignId {
+      return first + batch.size() * chunk / chunks;
+    };
+    std::vector<std::array<std::size_t, stem_id_count>> offsets(chunks);
+    run_chunks(chunks, [&](std::size_t chunk) {
+      for (auto id = chunk_begin(chunk); id < chunk_begin(chunk + 1); ++id)
+        for (const auto& req : _stem_counts(id))
+          offsets[chunk][req.stem.id()] += 1;
+    });
+    std::array<std::size_t, stem_id_count> added{};
+    for (const auto& counts : offsets)
+      for (StemId stem = 0; stem < stem_id_count; ++stem)
+        added[stem] += counts[stem];
+    _grow_slices(added);
+    for (StemId stem = 0; stem < stem_id_count; ++stem) {
+      std::size_t position = posting_offsets[stem + 1] - added[stem];
+      for (auto& counts : offsets)
+        position += std::exchange(counts[stem], position);
+    }
+    run_chunks(chunks, [&](std::size_t chunk) {
+      auto& next = offsets[chunk];
+      for (auto id = chunk_begin(chunk); id < chunk_begin(chunk + 1); ++id) {
+        const auto mask = _mask(_stem_counts(id));
+        for (const auto& req : _stem_counts(id))
+          postings[next[req.stem.id()]++] = {id, mask};
+      }
+    });
+    if (policy == OrderingPolicy::most_constrained)
+      for (StemId stem = 0; stem < stem_id_count; ++stem)
+        if (added[stem])
+          _sort_by_rank(_candidates(stem));
+  }
+
+  bool remove_design(const Design& design) noexcept {
+    // Retires the first design in the per-stem order that equals the given
+    // one, and returns whether there was one. Its handle is removed from
+    // the index, and its storage is reclaimed once retired designs make up
+    // half of the catalog.
+    const auto first = _candidates(design.stem_counts().front().stem.id());
+    const auto found = std::find_if(
+        first.begin(), first.end(),
+        [&](const auto& candidate) { return _is(candidate.id, design); });
+    if (found == first.end())
+      return false;
+    const auto id = found->id;
+    for (const auto& req : design.stem_counts())
+      _erase_candidate(req.stem.id(), id);
+    states[id].retired = true;
+    if (id >= _fixed_designs() &&
+        ++retired_designs * 2 >= catalog.size() - _fixed_designs())
+      _compact();
+    return true;
+  }
+
+  void load(const CatalogImage& image) {
+    // Adds the designs of a catalog image. Their records are copied into
+    // the catalog, and the per-stem index takes the image's postings with
+    // their masks as they are rather than indexing designs one by one.
+    catalog.reserve(catalog.size() + image.size());
+    const DesignId first = catalog.size();
+    for (DesignId id = 0; id < image.size(); ++id) {
+      for (const auto& option : image.options(id))
+        catalog_options.emplace_back(Stem::from_id(option.stem), option.count);
+      const auto stored =
+          _store_options(image.code(id), image.total(id), image.option_count(id));
+      loaded = _fingerprint(loaded, stored);
+    }
+    std::array<std::size_t, stem_id_count> added;
+    for (StemId stem = 0; stem < stem_id_count; ++stem)
+      added[stem] = image.postings(stem).size();
+    _grow_slices(added);
+    for (StemId stem = 0; stem < stem_id_count; ++stem) {
+      auto position = posting_offsets[stem + 1] - added[stem];
+      for (const auto& posting : image.postings(stem))
+        postings[position++] = {first + posting.id, posting.mask};
+      if (added[stem] && policy == OrderingPolicy::most_constrained)
+        _sort_by_rank(_candidates(stem));
+    }
+  }
+
+  void add_stem(const Stem& stem) noexcept {
+    _update_supply(stem.id(), supply[stem.id()] + 1);
+  }
+
+  // Time spent searching for a better plan in optimized batch order.
+  static constexpr std::chrono::microseconds default_budget{100};
+
+  template <typename Emit>
+  void add_stems(std::span<const Stem> stems, BatchOrder order, Emit emit,
+                 std::chrono::microseconds budget = default_budget) {
+    // Adds a batch of stems and calls emit() with each resulting Bouquet.
+    // The budget bounds the search for a better plan in optimized order.
+    if (order == BatchOrder::arrival) {
+      for (const auto& stem : stems) {
+        add_stem(stem);
+        if (auto bouquet = bouquet_for_stem(stem))
+          emit(*bouquet);
+      }
+      return;
+    }
+    if (order == BatchOrder::optimized) {
+      _plan_bouquets(stems, budget);
+      for (std::size_t index = 0; index < best_plan.size(); ++index) {
+        const auto id = best_plan[index];
+        emit(Bouquet{id, catalog[id].code, _take_planned(index, stems)});
+      }
+      return;
+    }
+    std::array<int, stem_id_count> arrivals{};
+    std::array<StemId, stem_id_count> distinct;
+    std::size_t distinct_count = 0;
+    for (const auto& stem : stems)
+      if (arrivals[stem.id()]++ == 0)
+        distinct[distinct_count++] = stem.id();
+    for (std::size_t index = 0; index < distinct_count; ++index) {
+      const auto id = distinct[index];
+      _update_supply(id, supply[id] + arrivals[id]);
+    }
+    for (std::size_t index = 0; index < distinct_count; ++index) {
+      const auto stem = Stem::from_id(distinct[index]);
+      while (auto bouquet = bouquet_for_stem(stem))
+        emit(*bouquet);
+    }
+  }
+
+  std::optional<Bouquet> bouquet_for_stem(const Stem& stem) noexcept {
+    // Returns an optional Bouquet, created from a Design containing the Stem.
+    // When a bouquet is created, the design it was created from is moved
+    // forward in the designs-for-stem vector as the ordering policy says.
+    // With a scan budget, designs past it are left for recheck().
+    COMPOSER_COUNT(++stats.calls);
+    pending &= ~_bit(stem.id());
+    return _scan(stem.id(), 0);
+  }
+
+  void set_scan_budget(std::size_t designs) noexcept {
+    // Limits the designs scanned per call to bouquet_for_stem() and
+    // recheck(), zero scans them all. A scan cut short leaves its stem
+    // pending a re-check, which continues the scan where it stopped.
+    scan_budget = designs;
+  }
+
+  bool has_pending_rechecks() const noexcept { return pending != 0; }
+
+  std::optional<Bouquet> recheck() noexcept {
+    // Continues the scan cut short for one stem pending a re-check, within
+    // the scan budget, and returns the Bouquet if it yields one.
+    if (!pending)
+      return std::nullopt;
+    const StemId stem = std::countr_zero(pending);
+    pending &= ~_bit(stem);
+    COMPOSER_COUNT(++stats.rechecks);
+    return _scan(stem, std::min(resume[stem], _candidates(stem).size()));
+  }
+
+  const ComposerStats& statistics() const noexcept { return stats; }
+
+  // A snapshot holds the catalog, including design updates, with the supply
+  // and the current order of the designs for each stem, for the same
+  // ordering policy. It restores only into a composer loaded with the same
+  // designs, before updates, as the one that saved it; their fingerprint is
+  // kept in the header. It is laid out in native byte order:
+  //   SnapshotHeader  magic, version, byte order mark, ordering policy,
+  //                   element counts and fingerprint of the loaded designs
+  //   int32_t         stem_id_count supply counts
+  //   SnapshotDesign  per design: code, number of options, whether it was
+  //                   retired, total and ordering rank
+  //   OptionRecord    per design option: stem id and bounded maximum count
+  //   uint32_t        stem_id_count + 1 offsets into the design ids
+  //   uint32_t        per stem, ids of its designs in their current order
+  static constexpr std::uint32_t snapshot_version = 3;
+
+  void save(std::vector<char>& snapshot) const {
+    // Writes a snapshot into the buffer, reusing its storage.
+    const SnapshotHeader head{{'C', 'A', 'R', 'R', 'S', 'N', 'P', '\0'},
+                              snapshot_version,
+                              byte_order_mark,
+                              std::uint32_t(policy),
+                              std::uint32_t(catalog.size()),
+                              std::uint32_t(catalog_options.size()),
+                              std::uint32_t(postings.size()),
+                              loaded};
+    snapshot.resize(sizeof(SnapshotHeader) + stem_id_count * 4 +
+                    catalog.size() * sizeof(SnapshotDesign) +
+                    catalog_options.size() * sizeof(OptionRecord) +
+                    (stem_id_count + 1 + postings.size()) * 4);
+    char* out = snapshot.data();
+    const auto put = [&out](const auto& value) {
+      out = static_cast<char*>(std::memcpy(out, &value, sizeof(value))) +
+            sizeof(value);
+    };
+    put(head);
+    for (const auto count : supply)
+      put(std::int32_t(count));
+    for (DesignId id = 0; id < catalog.size(); ++id) {
+      const auto code = catalog[id].code.format();
+      put(SnapshotDesign{{code[0], code[1]},
+                         catalog[id].options,
+                         states[id].retired,
+                         catalog[id].total,
+                         states[id].rank});
+    }
+    for (const auto& option : catalog_options)
+      put(OptionRecord{option.stem.id(), {}, option.count});
+    for (const auto offset : posting_offsets)
+      put(offset);
+    for (const auto& candidate : postings)
+      put(candidate.id);
+  }
+
+  void restore(std::string_view snapshot) {
+    // Restores the catalog, supply and design order from a snapshot of a
+    // composer with the same ordering policy, in place of the catalog this
+    // composer has. Nothing changes when the snapshot is invalid.
+    const auto invalid = [](const char* reason) {
+      auto err_msg = std::string("Invalid snapshot: ").append(reason);
+      return std::runtime_error(err_msg);
+    };
+    const auto get = [&snapshot]<typename T>(std::size_t index, T value) {
+      std::memcpy(&value, snapshot.data() + index, sizeof(T));
+      return value;
+    };
+    if (snapshot.size() < sizeof(SnapshotHeader))
+      throw invalid("truncated header");
+    const auto head = get(0, SnapshotHeader{});
+    if (std::string_view(head.magic, 8) != std::string_view("CARRSNP", 8))
+      throw invalid("not a snapshot");
+    if (head.version != snapshot_version ||
+        head.byte_order != byte_order_mark)
+      throw invalid("unsupported version or byte order");
+    if (head.policy != std::uint32_t(policy))
+      throw invalid("ordering policy does not match");
+    if (head.loaded != loaded)
+      throw invalid("catalog does not match");
+    const std::size_t supply_at = sizeof(SnapshotHeader);
+    const std::size_t designs_at = supply_at + stem_id_count * 4;
+    const std::size_t options_at =
+        designs_at + std::size_t(head.designs) * sizeof(SnapshotDesign);
+    const std::size_t offsets_at =
+        options_at + std::size_t(head.options) * sizeof(OptionRecord);
+    const std::size_t ids_at = offsets_at + (stem_id_count + 1) * 4;
+    if (snapshot.size() != ids_at + std::size_t(head.candidates) * 4)
+      throw invalid("size does not match contents");
+
+    // Designs are checked as a catalog image's are, and compiled-in designs
+    // must come first and be unchanged
+    std::vector<Design> designs;
+    std::vector<SnapshotDesign> records(head.designs);
+    std::vector<StemMask> masks(head.designs);
+    std::array<std::uint32_t, stem_id_count> live_per_stem{};
+    designs.reserve(head.designs);
+    std::size_t option = 0;
+    for (std::size_t id = 0; id < head.designs; ++id) {
+      const auto& record = records[id] =
+          get(designs_at + id * sizeof(SnapshotDesign), SnapshotDesign{});
+      if (record.options > Design::max_options || record.retired > 1 ||
+          option + record.options > head.options)
+        throw invalid("design options out of range");
+      std::array<OptionRecord, Design::max_options> specs;
+      for (std::size_t index = 0; index < record.options; ++index)
+        specs[index] = get(options_at + option++ * sizeof(OptionRecord),
+                           OptionRecord{});
+      const std::span<const OptionRecord> options(specs.data(), record.options);
+      masks[id] =
+          check_design_record(record.code, record.total, options, invalid);
+      for (const auto& spec : options)
+        live_per_stem[spec.stem] += !record.retired;
+      designs.push_back(design_from_records(
+          {record.code[0], record.code[1]}, options, record.total));
+    }
+    if (option != head.options)
+      throw invalid("size does not match contents");
+#ifdef COMPOSER_CATALOG
+    if (designs.size() < static_catalog.size())
+      throw invalid("catalog does not match the compiled-in one");
+    for (std::size_t id = 0; id < static_catalog.size(); ++id)
+      if (!(designs[id] == static_catalog[id].design()))
+        throw invalid("catalog does not match the compiled-in one");
+#endif
+
+    // Each design that was not retired is listed once for each of its stems
+    std::array<std::uint32_t, stem_id_count + 1> offsets;
+    for (std::size_t stem = 0; stem <= stem_id_count; ++stem)
+      offsets[stem] = get(offsets_at + stem * 4, std::uint32_t{});
+    if (offsets[0] != 0 || offsets[stem_id_count] != head.candidates)
+      throw invalid("design order offsets out of range");
+    std::vector<StemId> listed_for(head.designs, stem_id_count);
+    for (StemId stem = 0; stem < stem_id_count; ++stem) {
+      if (get(supply_at + stem * 4, std::int32_t{}) < 0)
+        throw invalid("negative supply");
+      if (offsets[stem] > offsets[stem + 1] ||
+          offsets[stem + 1] - offsets[stem] != live_per_stem[stem])
+        throw invalid("design order does not match the catalog");
+      for (auto index = offsets[stem]; index < offsets[stem + 1]; ++index) {
+        const auto id = get(ids_at + index * 4, DesignId{});
+        if (id >= head.designs || records[id].retired ||
+            !(masks[id] & _bit(stem)) || listed_for[id] == stem)
+          throw invalid("design order does not match the catalog");
+        listed_for[id] = stem;
+      }
+    }
+
+    catalog.clear();
+    catalog_options.clear();
+    states.clear();
+    option_offsets.clear();
+    option_stems.clear();
+    option_counts.clear();
+    pending = 0;
+    for (DesignId id = 0; id < head.designs; ++id) {
+      _store_design(designs[id]);
+      states[id].rank = records[id].rank;
+      states[id].retired = records[id].retired;
+    }
+    posting_offsets = offsets;
+    postings.resize(head.candidates);
+    for (std::size_t index = 0; index < postings.size(); ++index) {
+      const auto id = get(ids_at + index * 4, DesignId{});
+      postings[index] = {id, _mask(_stem_counts(id))};
+    }
+    for (StemId stem = 0; stem < stem_id_count; ++stem)
+      _update_supply(stem, get(supply_at + stem * 4, std::int32_t{}));
+    retired_designs = 0;
+    for (auto id = _fixed_designs(); id < catalog.size(); ++id)
+      retired_designs += states[id].retired;
+  }
+
+ private:
+  struct SnapshotHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint32_t policy;
+    std::uint32_t designs;
+    std::uint32_t options;
+    std::uint32_t candidates;
+    std::uint64_t loaded;
+  };
+  struct SnapshotDesign {
+    char code[2];
+    std::uint8_t options;
+    std::uint8_t retired;
+    std::int32_t total;
+    std::int32_t rank;
+  };
+
+  struct CatalogShape {
+    std::size_t designs = 0;
+    std::size_t options = 0;
+    std::size_t lanes = 0;
+
+    explicit CatalogShape(std::span<const Design> catalog) {
+      designs = catalog.size();
+      for (const auto& design : catalog) {
+        options += design.stem_counts().size();
+        lanes += _padded_lanes(design.stem_counts().size());
+      }
+    }
+    explicit CatalogShape(const CatalogImage& image) {
+      designs = image.size();
+      for (DesignId id = 0; id < image.size(); ++id) {
+        options += image.option_count(id);
+        lanes += _padded_lanes(image.option_count(id));
+      }
+    }
+  };
+
+  Composer(const CatalogShape& shape, OrderingPolicy policy)
+      : arena(_arena_size(shape)), policy(policy) {
+    catalog.reserve(shape.designs);
+    catalog_options.reserve(shape.options);
+    states.reserve(shape.designs);
+    option_offsets.reserve(shape.designs);
+    option_stems.reserve(shape.lanes);
+    option_counts.reserve(shape.lanes);
+    workspace.reserve(26);
+    postings.reserve(shape.options);
+  }
+
+  std::pmr::monotonic_buffer_resource arena;
+  OrderingPolicy policy;
+  ComposerStats stats;
+  std::pmr::vector<StemCount> workspace{&arena};
+  std::array<int, stem_id_count> supply{};
+
+  // The catalog holds each design's options in a pool shared by all designs,
+  // rather than the inline maximum of a Design.
+  struct CatalogDesign {
+    DesignCode code;
+    std::uint8_t options;
+    int total;
+    std::uint32_t first_option;
+  };
+  std::pmr::vector<CatalogDesign> catalog{&arena};
+  std::pmr::vector<StemCount> catalog_options{&arena};
+
+  std::span<const StemCount> _stem_counts(DesignId id) const noexcept {
+    return {catalog_options.data() + catalog[id].first_option,
+            catalog[id].options};
+  }
+
+  bool _is(DesignId id, const Design& design) const noexcept {
+    // Whether the catalog design is the given one.
+    return catalog[id].code == design.code() &&
+           catalog[id].total == design.total() &&
+           std::ranges::equal(_stem_counts(id), design.stem_counts());
+  }
+
+  // The per-stem design index keeps each design's mask of required stems
+  // next to its handle, checked against the mask of stems in supply. It is
+  // laid out flat, the candidates for a stem are the slice of postings from
+  // its offset up to the next stem's, reordered in place.
+  using StemMask = std::uint64_t;
+  struct Candidate {
+    DesignId id;
+    StemMask mask;
+  };
+  std::array<std::uint32_t, stem_id_count + 1> posting_offsets{};
+  std::pmr::vector<Candidate> postings{&arena};
+  StemMask stocked = 0;
+
+  std::span<Candidate> _candidates(StemId stem) noexcept {
+    return {postings.data() + posting_offsets[stem],
+            postings.data() + posting_offsets[stem + 1]};
+  }
+
+  void _grow_slices(const std::array<std::size_t, stem_id_count>& added) {
+    // Makes room for added[stem] more candidates at the end of the slice of
+    // each stem, moving the slices that follow it back.
+    auto shift = std::accumulate(added.begin(), added.end(), std::size_t(0));
+    postings.resize(postings.size() + shift);
+    for (auto stem = stem_id_count; stem-- > 0;) {
+      const auto begin = postings.begin() + posting_offsets[stem];
+      const auto end = postings.begin() + posting_offsets[stem + 1];
+      posting_offsets[stem + 1] += shift;
+      shift -= added[stem];
+      std::move_backward(begin, end, end + shift);
+    }
+  }
+
+  static constexpr StemMask _bit(StemId stem) noexcept {
+    return StemMask(1) << stem;
+  }
+
+  static StemMask _mask(std::span<const StemCount> stem_counts) noexcept {
+    StemMask mask = 0;
+    for (const auto& req : stem_counts)
+      mask |= _bit(req.stem.id());
+    return mask;
+  }
+
+  DesignId _store_design(const Design& design) noexcept {
+    // Stores the design with its rank and option lanes, but does not add it
+    // to the per-stem index.
+    catalog_options.insert(catalog_options.end(),
+                           design.stem_counts().begin(),
+                           design.stem_counts().end());
+    return _store_options(design.code(), design.total(),
+                          design.stem_counts().size());
+  }
+
+  DesignId _store_options(DesignCode code, int total,
+                          std::size_t options) noexcept {
+    // Stores a design as _store_design() does, its options being the last
+    // ones added to the pool.
+    const DesignId id = catalog.size();
+    catalog.push_back({code, std::uint8_t(options), total,
+                       std::uint32_t(catalog_options.size() - options)});
+    workspace.reserve(options);
+    auto& state = states.emplace_back();
+    option_offsets.push_back(option_stems.size());
+    if (policy == OrderingPolicy::most_constrained)
+      state.rank = total;
+    for (const auto& req : _stem_counts(id)) {
+      option_stems.push_back(req.stem.id());
+      option_counts.push_back(req.count);
+      if (policy == OrderingPolicy::most_constrained)
+        state.rank -= req.count;
+    }
+    const auto padded = _padded_lanes(options);
+    option_stems.resize(option_offsets.back() + padded, 0);
+    option_counts.resize(option_offsets.back() + padded, 0);
+    return id;
+  }
+
+  // A design's rank orders it under the frequency and most-constrained
+  // policies. Whether it is ready, its stems all stocked and their supply
+  // capped per option reaching its total, is only worked out by a scan.
+  // Per-design counters of the same would be updated on a supply change for
+  // each design using the stem, which costs as much as the scan of the
+  // arriving stem that they would save, and nearly every such scan that
+  // passes the stocked stems mask ends in a bouquet. Nor are designs kept
+  // in buckets by shortfall: after a scan finds none ready, some design is
+  // nearly always one stem short, so the bucket of ready designs would have
+  // to be checked on almost every arrival anyway.
+  struct DesignState {
+    int rank = 0;
+    bool retired = false;
+  };
+  std::size_t retired_designs = 0;
+
+  // Fingerprint of the designs loaded in bulk, excluding updates, hashing
+  // their fields FNV-1a style.
+  static constexpr std::uint64_t fingerprint_basis = 0xcbf29ce484222325;
+  std::uint64_t loaded = fingerprint_basis;
+
+  std::uint64_t _fingerprint(std::uint64_t hash, DesignId id) const noexcept {
+    const auto mix = [&hash](std::uint64_t value) {
+      hash = (hash ^ value) * 0x100000001b3;
+    };
+    const auto code = catalog[id].code.format();
+    mix(std::uint8_t(code[0]));
+    mix(std::uint8_t(code[1]));
+    mix(std::uint32_t(catalog[id].total));
+    for (const auto& req : _stem_counts(id)) {
+      mix(req.stem.id());
+      mix(std::uint32_t(req.count));
+    }
+    return hash;
+  }
+
+  // Scans cut short by the scan budget, to continue from their position.
+  std::size_t scan_budget = 0;
+  StemMask pending = 0;
+  std::array<std::size_t, stem_id_count> resume{};
+  std::pmr::vector<DesignState> states{&arena};
+  std::pmr::vector<std::int32_t> option_stems{&arena};
+  std::pmr::vector<std::int32_t> option_counts{&arena};
+  std::pmr::vector<std::size_t> option_offsets{&arena};
+
+  static constexpr std::size_t _padded_lanes(std::size_t options) noexcept {
+    return (options + option_lanes - 1) / option_lanes * option_lanes;
+  }
+
+  static std::size_t _arena_size(const CatalogShape& shape) noexcept {
+    // Bytes needed for the reserved containers.
+    constexpr std::size_t per_design =
+        sizeof(CatalogDesign) + sizeof(DesignState) + sizeof(std::size_t);
+    constexpr std::size_t per_option = sizeof(Candidate) + sizeof(StemCount);
+    constexpr std::size_t fixed = 26 * sizeof(StemCount);
+    return fixed + shape.designs * per_design + shape.options * per_option +
+           shape.lanes * 2 * sizeof(std::int32_t);
+  }
+
+  // Search state for planning bouquets in optimized batch order: the plan
+  // being explored with the stems it took, and the best plan found with the
+  // stems it takes. The design order changes made by the arrival order plan
+  // are logged, to undo them for a better plan.
+  std::pmr::vector<DesignId> plan{&arena};
+  std::pmr::vector<DesignId> plan_candidates{&arena};
+  std::pmr::vector<StemCount> taken{&arena};
+  std::pmr::vector<std::size_t> taken_offsets{&arena};
+  std::pmr::vector<DesignId> best_plan{&arena};
+  std::pmr::vector<StemCount> best_taken{&arena};
+  std::pmr::vector<std::size_t> best_taken_offsets{&arena};
+  bool plan_improved = false;
+  struct Reorder {
+    StemId stem;
+    std::size_t from;
+    std::size_t to;
+  };
+  std::pmr::vector<Reorder> reorders{&arena};
+
+  void _plan_bouquets(std::span<const Stem> stems,
+                      std::chrono::microseconds budget) {
+    // Adds the stems to the supply and plans bouquets into best_plan, as
+    // many as it can. The plan of arrival order, composing a bouquet for
+    // each stem as it is added, is replaced only by one with more bouquets,
+    // from a branch and bound search over combinations of the designs that
+    // can be completed from the whole supply. The search runs until it is
+    // done or the budget runs out, and is skipped when the arrival order
+    // plan used it up; on large catalogs it rarely completes.
+    // The planned stems are left in supply.
+    using clock = std::chrono::steady_clock;
+    const auto deadline = clock::now() + budget;
+    reorders.clear();
+    for (const auto& stem : stems) {
+      const auto id = stem.id();
+      _update_supply(id, supply[id] + 1);
+      pending &= ~_bit(id);
+      const auto candidates = _candidates(id);
+      const auto handle = std::find_if(
+          candidates.begin(), candidates.end(), [this](const auto& candidate) {
+            return (candidate.mask & stocked) == candidate.mask &&
+                   _select(candidate.id);
+          });
+      if (handle == candidates.end())
+        continue;
+      _push_plan(handle->id);
+      const std::size_t from = handle - candidates.begin();
+      reorders.push_back({id, from, from - _reorder(candidates, handle)});
+    }
+    _keep_best_plan();
+    plan_improved = false;
+    while (!plan.empty())
+      _pop_plan();
+    if (clock::now() >= deadline)
+      return;
+
+    plan_candidates.clear();
+    for (StemId stem = 0; stem < stem_id_count; ++stem) {
+      if (!(stocked & _bit(stem)))
+        continue;
+      for (const auto& candidate : _candidates(stem))
+        if ((candidate.mask & stocked) == candidate.mask)
+          plan_candidates.push_back(candidate.id);
+    }
+    std::sort(plan_candidates.begin(), plan_candidates.end());
+    plan_candidates.erase(
+        std::unique(plan_candidates.begin(), plan_candidates.end()),
+        plan_candidates.end());
+    std::erase_if(plan_candidates, [this](auto id) { return !_select(id); });
+    if (plan_candidates.empty())
+      return;
+    int smallest = std::numeric_limits<int>::max();
+    for (const auto id : plan_candidates)
+      smallest = std::min(smallest, catalog[id].total);
+    int remaining = 0;
+    for (const auto count : supply)
+      remaining += count;
+    std::size_t steps = 0;
+    _search_plans(0, remaining, smallest, [&] {
+      return steps++ % 64 != 0 || clock::now() < deadline;
+    });
+    if (plan_improved)
+      _undo_reorders();
+  }
+
+  void _keep_best_plan() {
+    // Keeps the plan being explored, with its stems, as the best plan.
+    best_plan.assign(plan.begin(), plan.end());
+    best_taken.assign(taken.begin(), taken.end());
+    best_taken_offsets.assign(taken_offsets.begin(), taken_offsets.end());
+    best_taken_offsets.push_back(taken.size());
+    plan_improved = true;
+  }
+
+  void _undo_reorders() noexcept {
+    // Reverts the design order changes of the arrival order plan.
+    for (auto entry = reorders.rbegin(); entry != reorders.rend(); ++entry) {
+      const auto candidates = _candidates(entry->stem);
+      const auto position = candidates.begin() + entry->to;
+      if (policy == OrderingPolicy::frequency)
+        --states[position->id].rank;
+      std::rotate(position, position + 1, candidates.begin() + entry->from + 1);
+    }
+  }
+
+  std::span<const StemCount> _take_planned(std::size_t index,
+                                           std::span<const Stem> stems) {
+    // Takes the stems of a planned bouquet from supply and returns them. A
+    // design from a better plan than that of arrival order then moves
+    // forward for the first stem of the batch that it uses.
+    const std::span<const StemCount> arrangement{
+        best_taken.data() + best_taken_offsets[index],
+        best_taken.data() + best_taken_offsets[index + 1]};
+    for (const auto& spec : arrangement)
+      _update_supply(spec.stem.id(), supply[spec.stem.id()] - spec.count);
+    if (!plan_improved) {
+      COMPOSER_COUNT(_count_rotation(reorders[index].from -
+                                     reorders[index].to));
+      return arrangement;
+    }
+    [[maybe_unused]] std::size_t moved = 0;
+    const auto mask = _mask(_stem_counts(best_plan[index]));
+    const auto first = std::find_if(
+        stems.begin(), stems.end(),
+        [&](const auto& stem) { return (mask & _bit(stem.id())) != 0; });
+    if (first != stems.end()) {
+      const auto candidates = _candidates(first->id());
+      moved = _reorder(
+          candidates, std::find_if(candidates.begin(), candidates.end(),
+                                   [&](const auto& candidate) {
+                                     return candidate.id == best_plan[index];
+                                   }));
+    }
+    COMPOSER_COUNT(_count_rotation(moved));
+    return arrangement;
+  }
+
+  template <typename InTime>
+  bool _search_plans(std::size_t first, int remaining, int smallest,
+                     InTime in_time) {
+    // Extends the plan with designs from plan_candidates[first:], each plan
+    // being a combination. Returns false once the budget has run out. Each
+    // bouquet takes a stem of its design's scarcest stem, which bounds how
+    // many more bouquets there can be, besides the stems remaining.
+    if (plan.size() > best_plan.size())
+      _keep_best_plan();
+    StemMask scarcest = 0;
+    for (auto index = first; index < plan_candidates.size(); ++index) {
+      StemId stem = 0;
+      int least = std::numeric_limits<int>::max();
+      for (const auto& req : _stem_counts(plan_candidates[index]))
+        if (supply[req.stem.id()] < least)
+          least = supply[(stem = req.stem.id())];
+      if (least > 0)
+        scarcest |= _bit(stem);
+    }
+    std::size_t scarce = 0;
+    for (auto bits = scarcest; bits; bits &= bits - 1)
+      scarce += supply[std::countr_zero(bits)];
+    const auto bound =
+        plan.size() + std::min<std::size_t>(remaining / smallest, scarce);
+    if (bound <= best_plan.size())
+      return true;
+    for (auto index = first; index < plan_candidates.size(); ++index) {
+      if (!in_time())
+        return false;
+      const auto id = plan_candidates[index];
+      if (!_select(id))
+        continue;
+      _push_plan(id);
+      const bool done =
+          _search_plans(index, remaining - catalog[id].total, smallest,
+                        in_time);
+      _pop_plan();
+      if (!done)
+        return false;
+    }
+    return true;
+  }
+
+  void _push_plan(DesignId id) {
+    // Adds the design to the plan, taking the selected stems from supply.
+    taken_offsets.push_back(taken.size());
+    taken.insert(taken.end(), workspace.begin(), workspace.end());
+    _take_arrangement_from_supply();
+    plan.push_back(id);
+  }
+
+  void _pop_plan() {
+    // Removes the last design from the plan, returning its stems to supply.
+    for (auto index = taken_offsets.back(); index < taken.size(); ++index) {
+      const auto& spec = taken[index];
+      _update_supply(spec.stem.id(), supply[spec.stem.id()] + spec.count);
+    }
+    taken.resize(taken_offsets.back());
+    taken_offsets.pop_back();
+    plan.pop_back();
+  }
+
+  void _update_supply(StemId stem, int count) noexcept {
+    // Sets the supply for a stem.
+    [[maybe_unused]] const int previous = std::exchange(supply[stem], count);
+    stocked = count > 0 ? stocked | _bit(stem) : stocked & ~_bit(stem);
+    COMPOSER_COUNT(stats.supply += count - previous);
+    COMPOSER_COUNT(stats.max_supply = std::max(stats.max_supply, stats.supply));
+  }
+
+  bool _select(DesignId id) noexcept {
+    // Selects stems for the design, through its unrolled static selection
+    // function when the catalog is compiled in. Designs added at runtime on
+    // top of it use the generic selection.
+#ifdef COMPOSER_CATALOG
+    if (id < static_catalog.size())
+      return static_catalog[id].select(supply, workspace);
+    return _select_stems(id);
+#else
+    return _select_stems(id);
+#endif
+  }
+
+  bool _select_stems(DesignId id) noexcept {
+    // Selects stems of design into workspace and returns completion of bouquet.
+    // The available supply capped per option is computed for all options at
+    // once, leaving only the running remainder to the sequential pass.
+    const auto& design = catalog[id];
+    const auto stem_counts = _stem_counts(id);
+    const auto offset = option_offsets[id];
+    std::array<std::int32_t, _padded_lanes(26)> capped;
+    cap_options(supply.data(), option_stems.data() + offset,
+                option_counts.data() + offset, capped.data(),
+                _padded_lanes(stem_counts.size()));
+    workspace.clear();
+    auto remaining = design.total;
+    auto remaining_options = stem_counts.size();
+    for (const auto& option : stem_counts) {
+      if (const auto available = capped[workspace.size()]) {
+        const int maximum_take = remaining - (--remaining_options);
+        const auto take = std::min(available, maximum_take);
+        workspace.emplace_back(option.stem, take);
+        remaining -= take;
+      } else {
+        return false;
+      }
+    }
+    return remaining == 0;
+  }
+
+  int _rank(const Candidate& candidate) const noexcept {
+    return states[candidate.id].rank;
+  }
+
+  void _sort_by_rank(std::span<Candidate> candidates) {
+    // Orders a per-stem list by rank, as _insert_candidate() keeps it.
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [this](const auto& left, const auto& right) {
+                       return _rank(left) > _rank(right);
+                     });
+  }
+
+  void _insert_candidate(StemId stem, Candidate candidate) {
+    // Adds a design to a per-stem list, in rank order if the order is static,
+    // moving the slices of the stems that follow it back. A pending scan
+    // continues from the same design.
+    const auto candidates = _candidates(stem);
+    auto position = candidates.end();
+    if (policy == OrderingPolicy::most_constrained)
+      position = std::upper_bound(
+          candidates.begin(), candidates.end(), candidate,
+          [this](const auto& left, const auto& right) {
+            return _rank(left) > _rank(right);
+          });
+    const std::size_t index = position - candidates.begin();
+    postings.insert(postings.begin() + posting_offsets[stem] + index,
+                    candidate);
+    for (std::size_t next = stem + 1; next <= stem_id_count; ++next)
+      posting_offsets[next] += 1;
+    if (index < resume[stem])
+      resume[stem] += 1;
+  }
+
+  static constexpr DesignId _fixed_designs() noexcept {
+    // Designs compiled into the binary keep their ids, which select their
+    // unrolled functions.
+#ifdef COMPOSER_CATALOG
+    return static_catalog.size();
+#else
+    return 0;
+#endif
+  }
+
+  void _compact() {
+    // Drops retired designs from the catalog, moving the designs after them
+    // down in order, and renumbers their handles in the index. Positions in
+    // the per-stem lists are unchanged.
+    const DesignId fixed = _fixed_designs();
+    if (fixed >= catalog.size())
+      return;
+    std::vector<DesignId> renumbered(catalog.size());
+    std::iota(renumbered.begin(), renumbered.begin() + fixed, DesignId(0));
+    DesignId kept = fixed;
+    std::size_t options = catalog[fixed].first_option;
+    std::size_t lanes = option_offsets[fixed];
+    for (DesignId id = fixed; id < catalog.size(); ++id) {
+      if (states[id].retired)
+        continue;
+      const auto design = catalog[id];
+      const auto padded = _padded_lanes(design.options);
+      if (kept != id) {
+        const auto from = option_offsets[id];
+        std::copy_n(catalog_options.begin() + design.first_option,
+                    design.options, catalog_options.begin() + options);
+        std::copy_n(option_stems.begin() + from, padded,
+                    option_stems.begin() + lanes);
+        std::copy_n(option_counts.begin() + from, padded,
+                    option_counts.begin() + lanes);
+        catalog[kept] = design;
+        catalog[kept].first_option = options;
+        states[kept] = states[id];
+        option_offsets[kept] = lanes;
+      }
+      renumbered[id] = kept++;
+      options += design.options;
+      lanes += padded;
+    }
+    catalog.erase(catalog.begin() + kept, catalog.end());
+    states.erase(states.begin() + kept, states.end());
+    option_offsets.erase(option_offsets.begin() + kept, option_offsets.end());
+    catalog_options.erase(catalog_options.begin() + options,
+                          catalog_options.end());
+    option_stems.erase(option_stems.begin() + lanes, option_stems.end());
+    option_counts.erase(option_counts.begin() + lanes, option_counts.end());
+    for (auto& candidate : postings)
+      candidate.id = renumbered[candidate.id];
+    retired_designs = 0;
+  }
+
+  void _erase_candidate(StemId stem, DesignId id) {
+    // Removes a design from a per-stem list, moving the slices that follow.
+    // A pending scan continues from the same design. Nothing changes if the
+    // design is not listed for the stem.
+    const auto candidates = _candidates(stem);
+    const auto found = std::find_if(
+        candidates.begin(), candidates.end(),
+        [id](const auto& candidate) { return candidate.id == id; });
+    if (found == candidates.end())
+      return;
+    const std::size_t index = found - candidates.begin();
+    postings.erase(postings.begin() + posting_offsets[stem] + index);
+    for (std::size_t next = stem + 1; next <= stem_id_count; ++next)
+      posting_offsets[next] -= 1;
+    if (index < resume[stem])
+      resume[stem] -= 1;
+  }
+
+  std::optional<Bouquet> _scan(StemId stem, std::size_t from) noexcept {
+    // Scans the designs for the stem from the given position for one that
+    // yields a bouquet, and reorders it. When the scan budget runs out first,
+    // the stem is left pending a re-check from where the scan stopped.
+    const auto dvec = _candidates(stem);
+    const auto left = dvec.size() - from;
+    const auto end = dvec.begin() + from +
+                     (scan_budget ? std::min(scan_budget, left) : left);
+    for (auto handle = dvec.begin() + from; handle != end; ++handle) {
+      COMPOSER_COUNT(++stats.designs_scanned);
+      if ((handle->mask & stocked) != handle->mask) {
+        COMPOSER_COUNT(++stats.mask_rejects);
+        continue;
+      }
+      const auto id = handle->id;
+      COMPOSER_COUNT(++stats.selections);
+      if (_select(id)) {
+        _take_arrangement_from_supply();
+        [[maybe_unused]] const auto moved = _reorder(dvec, handle);
+        COMPOSER_COUNT(_count_rotation(moved));
+        return Bouquet{id, catalog[id].code, workspace};
+      }
+    }
+    if (end != dvec.end()) {
+      COMPOSER_COUNT(++stats.budget_cuts);
+      pending |= _bit(stem);
+      resume[stem] = end - dvec.begin();
+    }
+    return std::nullopt;
+  }
+
+  std::size_t _reorder(std::span<Candidate> candidates,
+                       std::span<Candidate>::iterator handle) noexcept {
+    // Moves the design that yielded a bouquet forward and returns how far.
+    // It moves only over designs already scanned, at the cost of the scan.
+    auto position = handle;
+    if (policy == OrderingPolicy::move_to_front) {
+      position = candidates.begin();
+    } else if (policy == OrderingPolicy::frequency) {
+      const auto rank = ++states[handle->id].rank;
+      while (position != candidates.begin() && _rank(*(position - 1)) < rank)
+        --position;
+    }
+    std::rotate(position, handle, handle + 1);
+    return handle - position;
+  }
+
+  void _count_rotation(std::uint64_t distance) noexcept {
+    ++stats.bouquets;
+    stats.rotate_distance += distance;
+    stats.max_rotate_distance = std::max(stats.max_rotate_distance, distance);
+  }
+
+  void _take_arrangement_from_supply() noexcept {
+    // Removes the stems in the workspace from the supply.
+    for (const auto& spec : workspace)
+      _update_supply(spec.stem.id(), supply[spec.stem.id()] - spec.count);
+  }
+};
+
+// Lines in the stem stream can also update the catalog between stems:
+//   +<design>  adds the design, after existing ones in the per-stem order
+//   -<design>  retires the first existing design equal to the given one
+inline std::vector<Design> parse_designs(std::string_view lines) {
+  // Parses a design per line, in chunks of whole lines on their own threads.
+  // The chunks are joined in order, so the catalog order is that of the text.
+  const auto count = std::count(lines.begin(), lines.end(), '\n');
+  const auto chunks = load_chunks(count);
+  std::vector<std::size_t> bounds{0};
+  for (std::size_t chunk = 1; chunk < chunks; ++chunk) {
+    const auto newline = lines.find('\n', lines.size() * chunk / chunks);
+    bounds.push_back(std::min(newline, lines.size() - 1) + 1);
+  }
+  bounds.push_back(lines.size());
+  std::vector<std::vector<Design>> parsed(chunks);
+  run_chunks(chunks, [&](std::size_t chunk) {
+    auto text = lines.substr(bounds[chunk], bounds[chunk + 1] - bounds[chunk]);
+    parsed[chunk].reserve(count / chunks + 1);
+    while (!text.empty()) {
+      const auto line = text.substr(0, text.find('\n'));
+      parsed[chunk].emplace_back(line);
+      text.remove_prefix(std::min(line.size() + 1, text.size()));
+    }
+  });
+  if (chunks == 1)
+    return std::move(parsed.front());
+  std::vector<Design> designs;
+  designs.reserve(count + 1);
+  for (const auto& chunk : parsed)
+    designs.insert(designs.end(), chunk.begin(), chunk.end());
+  return designs;
+}
+
+inline bool is_design_update(std::string_view line) noexcept {
+  return line.starts_with('+') || line.starts_with('-');
+}
+
+inline void apply_design_update(Composer& composer, std::string_view line) {
+  // Applies a design update line to the composer.
+  const Design design{line.substr(1)};
+  if (line.front() == '+') {
+    composer.add_design(design);
+  } else if (!composer.remove_design(design)) {
+    auto err_msg = std::string("No such design to remove: ").append(line);
+    throw std::invalid_argument(err_msg);
+  }
+}
+
+class OutputBuffer : public std::streambuf {
+  // Stream buffer that batches output into large writes on a file descriptor.
+  // Output is written when the buffer fills up, on flush, and with a nonzero
+  // flush interval, periodically from a background thread. Writers hold the
+  // lock() guard while streaming so the background flush never sees a
+  // partially formatted record.
+ public:
+  OutputBuffer(int fd, std::chrono::milliseconds flush_interval,
+               std::size_t capacity = 1 << 16)
+      : fd(fd), buffer(capacity) {
+    setp(buffer.data(), buffer.data() + buffer.size());
+    if (flush_interval.count() > 0)
+      flusher = std::jthread([this, flush_interval](std::stop_token stop) {
+        std::unique_lock guard{mutex};
+        while (!stop.stop_requested()) {
+          interval.wait_for(guard, stop, flush_interval, [] { return false; });
+          _write_out();
+        }
+      });
+  }
+  ~OutputBuffer() override {
+    if (flusher.joinable()) {
+      flusher.request_stop();
+      flusher.join();
+    }
+    _write_out();
+  }
+
+  std::unique_lock<std::mutex> lock() { return std::unique_lock{mutex}; }
+
+ protected:
+  int_type overflow(int_type ch) override {
+    if (!_write_out())
+      return traits_type::eof();
+    if (!traits_type::eq_int_type(ch, traits_type::eof()))
+      sputc(traits_type::to_char_type(ch));
+    return traits_type::not_eof(ch);
+  }
+  int sync() override { return _write_out() ? 0 : -1; }
+
+ private:
+  int fd;
+  std::vector<char> buffer;
+  std::mutex mutex;
+  std::condition_variable_any interval;
+  std::jthread flusher;
+
+  bool _write_out() noexcept {
+    // Writes the buffered output to the file descriptor and resets the buffer.
+    for (const char* data = pbase(); data < pptr();) {
+      const auto written = ::write(fd, data, pptr() - data);
+      if (written < 0 && errno != EINTR)
+        return false;
+      if (written > 0)
+        data += written;
+    }
+    setp(buffer.data(), buffer.data() + buffer.size());
+    return true;
+  }
+};
+
+class SnapshotWriter {
+  // Writes composer snapshots to a file from a background thread. Snapshots
+  // are saved into buffer() on the composer's thread and handed over with
+  // submit(), which only swaps buffers, so writing stays off the stem path.
+  // Each snapshot goes to a temporary file that is renamed over the path,
+  // leaving a complete snapshot on disk at all times. With a nonzero
+  // interval, due() turns true periodically, for the composer's thread to
+  // save a snapshot when it next processes a stem.
+ public:
+  SnapshotWriter(std::string path, std::chrono::milliseconds interval)
+      : path(std::move(path)) {
+    writer = std::jthread([this, interval](std::stop_token stop) {
+      std::unique_lock guard{mutex};
+      while (!stop.stop_requested()) {
+        const auto is_pending = [this] { return pending; };
+        if (interval.count() > 0 &&
+            !wake.wait_for(guard, stop, interval, is_pending)) {
+          requested.store(true, std::memory_order_relaxed);
+          continue;
+        }
+        if (!wake.wait(guard, stop, is_pending))
+          continue;
+        std::swap(back, writing);
+        pending = false;
+        guard.unlock();
+        _write_file(writing);
+        guard.lock();
+      }
+    });
+  }
+  ~SnapshotWriter() {
+    writer.request_stop();
+    writer.join();
+    if (pending)
+      _write_file(back);
+  }
+
+  std::vector<char>& buffer() noexcept { return front; }
+
+  void submit() {
+    // Hands the snapshot in buffer() to the writer, replacing any snapshot
+    // it has not started writing yet.
+    {
+      const std::lock_guard guard{mutex};
+      std::swap(front, back);
+      pending = true;
+    }
+    wake.notify_one();
+  }
+
+  bool due() noexcept {
+    return requested.load(std::memory_order_relaxed) &&
+           requested.exchange(false, std::memory_order_relaxed);
+  }
+
+ private:
+  std::string path;
+  std::vector<char> front;
+  std::vector<char> back;
+  std::vector<char> writing;
+  bool pending = false;
+  std::atomic<bool> requested{false};
+  std::mutex mutex;
+  std::condition_variable_any wake;
+  std::jthread writer;
+
+  void _write_file(const std::vector<char>& snapshot) noexcept {
+    // Writes and syncs the snapshot to a temporary file, then renames it.
+    const auto temporary = path + ".tmp";
+    const int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = fd >= 0;
+    const char* end = snapshot.data() + snapshot.size();
+    for (const char* data = snapshot.data(); written && data < end;) {
+      const auto bytes = ::write(fd, data, end - data);
+      written = bytes >= 0 || errno == EINTR;
+      if (bytes > 0)
+        data += bytes;
+    }
+    written = written && fsync(fd) == 0;
+    if (fd >= 0)
+      written = close(fd) == 0 && written;
+    if (!written || std::rename(temporary.c_str(), path.c_str()) != 0)
+      std::fprintf(stderr, "Cannot write snapshot %s: %s\n", path.c_str(),
+                   std::strerror(errno));
+  }
+};
+
+class LineReader {
+  // Reads lines as views into its input, without copying them. Regular files
+  // are memory mapped from their current offset to the end, other inputs
+  // (pipes, terminals) are read in large blocks. Views remain valid until the
+  // next call to readline(). Binary input following the lines is read with
+  // readbyte().
+ public:
+  explicit LineReader(int fd, std::size_t block_size = 1 << 20) : fd(fd) {
+    struct stat info;
+    const off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && offset >= 0 &&
+        offset < info.st_size) {
+      // Mappings start on a page boundary, the bytes before offset are skipped
+      const off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+      const std::size_t size = info.st_size - start;
+      void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, start);
+      if (map != MAP_FAILED) {
+        madvise(map, size, MADV_SEQUENTIAL);
+        mapping = {static_cast<const char*>(map), size};
+        pos = mapping.data() + (offset - start);
+        end = mapping.data() + mapping.size();
+        return;
+      }
+    }
+    buffer.resize(block_size);
+    pos = end = buffer.data();
+  }
+  LineReader(const LineReader&) = delete;
+  LineReader& operator=(const LineReader&) = delete;
+  ~LineReader() {
+    if (!mapping.empty())
+      munmap(const_cast<char*>(mapping.data()), mapping.size());
+  }
+
+  bool readline(std::string_view& line) {
+    // Reads a line, signaling the end of a paragraph in addition to EOF.
+    std::size_t scanned = 0;
+    const void* newline;
+    while (!(newline = std::memchr(pos + scanned, '\n', end - pos - scanned))) {
+      scanned = end - pos;
+      if (!_refill()) {
+        line = {pos, end};
+        pos = end;
+        return !line.empty();
+      }
+    }
+    line = {pos, static_cast<const char*>(newline)};
+    pos = line.end() + 1;
+    return !line.empty();
+  }
+
+  std::string_view readparagraph() {
+    // Reads the lines up to a blank line or EOF, as readline() would one by
+    // one, and returns them as a single view including their newlines.
+    std::size_t scanned = 0;
+    while (true) {
+      const auto* newline = static_cast<const char*>(
+          std::memchr(pos + scanned, '\n', end - pos - scanned));
+      if (newline && (newline == pos || newline[-1] == '\n')) {
+        const std::string_view paragraph{pos, newline};
+        pos = newline + 1;
+        return paragraph;
+      }
+      if (newline) {
+        scanned = newline + 1 - pos;
+      } else if (scanned = end - pos; !_refill()) {
+        const std::string_view paragraph{pos, end};
+        pos = end;
+        return paragraph;
+      }
+    }
+  }
+
+  bool readbyte(char& byte) {
+    // Reads a single byte of raw input, for binary streams. False at EOF.
+    if (pos == end && !_refill())
+      return false;
+    byte = *pos++;
+    return true;
+  }
+
+ private:
+  int fd;
+  std::string_view mapping;
+  std::vector<char> buffer;
+  const char* pos;
+  const char* end;
+
+  bool _refill() {
+    // Moves the unread tail to the front of the buffer and reads more input.
+    // Returns false when there is no more input to read.
+    if (!mapping.empty())
+      return false;
+    const std::size_t unread = end - pos;
+    std::memmove(buffer.data(), pos, unread);
+    if (unread == buffer.size())
+      buffer.resize(buffer.size() * 2);
+    pos = buffer.data();
+    end = pos + unread;
+    while (true) {
+      const auto space = buffer.size() - unread;
+      const auto bytes = ::read(fd, buffer.data() + unread, space);
+      if (bytes < 0 && errno == EINTR)
+        continue;
+      if (bytes < 0)
+        throw std::system_error(errno, std::generic_category(), "read");
+      end += bytes;
+      return bytes > 0;
+    }
+  }
+};
+
+template <typename T>
+class SpscQueue {
+  // Bounded lock-free queue between a single producer and single consumer.
+  // Both sides spin briefly and then wait while the queue is full or empty.
+ public:
+  explicit SpscQueue(std::size_t capacity)
+      : slots(std::bit_ceil(capacity)), mask(slots.size() - 1) {}
+
+  void push(T value) noexcept {
+    const auto position = tail.load(std::memory_order_relaxed);
+    while (position - head_seen == slots.size())
+      head_seen = _await_change(head, head_seen);
+    slots[position & mask] = std::move(value);
+    tail.store(position + 1, std::memory_order_release);
+    tail.notify_one();
+  }
+
+  bool try_pop(T& value) noexcept {
+    // Pops a value into value if there is one, without waiting.
+    const auto position = head.load(std::memory_order_relaxed);
+    if (position == tail_seen &&
+        position == (tail_seen = tail.load(std::memory_order_acquire)))
+      return false;
+    value = std::move(slots[position & mask]);
+    head.store(position + 1, std::memory_order_release);
+    head.notify_one();
+    return true;
+  }
+
+  T pop() noexcept {
+    const auto position = head.load(std::memory_order_relaxed);
+    while (position == tail_seen)
+      tail_seen = _await_change(tail, tail_seen);
+    T value = std::move(slots[position & mask]);
+    head.store(position + 1, std::memory_order_release);
+    head.notify_one();
+    return value;
+  }
+
+ private:
+  alignas(64) std::atomic<std::size_t> head{0};
+  std::size_t tail_seen = 0;  // Consumer's last observed tail
+  alignas(64) std::atomic<std::size_t> tail{0};
+  std::size_t head_seen = 0;  // Producer's last observed head
+  alignas(64) std::vector<T> slots;
+  const std::size_t mask;
+
+  static std::size_t _await_change(const std::atomic<std::size_t>& position,
+                                   std::size_t seen) noexcept {
+    for (int spin = 0; spin < 256; ++spin) {
+      const auto now = position.load(std::memory_order_acquire);
+      if (now != seen)
+        return now;
+    }
+    position.wait(seen, std::memory_order_acquire);
+    return position.load(std::memory_order_acquire);
+  }
+};
+
+// What the next item of a stem stream is. Streams read ahead on a thread of
+// their own are idle when no item has been read yet.
+enum class InputEvent { stem, design_update, idle, end };
+
+class ReadAhead {
+  // Reads a stem stream on a thread of its own, ahead of the thread that
+  // composes bouquets. Stems are handed over through a lock-free queue, and
+  // design update lines, in order, through a second one. The composing
+  // thread can ask not to wait for input, to use gaps in it for other work.
+ public:
+  template <typename Read>
+  explicit ReadAhead(Read read)
+      : reader([this, read](std::stop_token stop) mutable {
+          try {
+            Stem stem = Stem::from_id(0);
+            std::string_view line;
+            for (auto event = read(stem, line);
+                 event != InputEvent::end && !stop.stop_requested();
+                 event = read(stem, line)) {
+              if (event == InputEvent::design_update)
+                updates.push(std::string(line));
+              arrivals.push(event == InputEvent::stem ? stem.id() : update);
+            }
+          } catch (...) {
+            error = std::current_exception();
+          }
+          arrivals.push(end_of_input);
+        }) {}
+  ReadAhead(const ReadAhead&) = delete;
+  ReadAhead& operator=(const ReadAhead&) = delete;
+  ~ReadAhead() {
+    // Stops the reader after its current read, and drains what it queued.
+    reader.request_stop();
+    while (!done)
+      _take(arrivals.pop());
+  }
+
+  InputEvent next(Stem& stem, std::string_view& line, bool wait) {
+    // Returns the next event read, like the reader returned it. Without
+    // waiting, returns idle when nothing has been read since the last call.
+    // Line views remain valid until the next call.
+    StemId id;
+    if (done)
+      return InputEvent::end;
+    if (!arrivals.try_pop(id)) {
+      if (!wait)
+        return InputEvent::idle;
+      id = arrivals.pop();
+    }
+    const auto event = _take(id);
+    if (event == InputEvent::end && error)
+      std::rethrow_exception(std::exchange(error, nullptr));
+    if (event == InputEvent::stem)
+      stem = Stem::from_id(id);
+    else if (event == InputEvent::design_update)
+      line = current_update;
+    return event;
+  }
+
+ private:
+  static constexpr std::size_t queue_size = 1 << 14;
+  static constexpr StemId update = 0xFE;
+  static constexpr StemId end_of_input = 0xFF;
+
+  SpscQueue<StemId> arrivals{queue_size};
+  SpscQueue<std::string> updates{queue_size / 256};
+  std::string current_update;
+  std::exception_ptr error;
+  bool done = false;
+  std::jthread reader;
+
+  InputEvent _take(StemId id) {
+    // Takes the item for a queued id off the queues.
+    if (id == end_of_input) {
+      done = true;
+      return InputEvent::end;
+    }
+    if (id == update) {
+      current_update = updates.pop();
+      return InputEvent::design_update;
+    }
+    return InputEvent::stem;
+  }
+};
+
+struct StemPartition {
+  // Assignment of stems to shards such that no design spans two shards.
+  std::size_t shards;
+  std::array<std::uint8_t, stem_id_count> shard_of;
+};
+
+inline StemPartition partition_stems(const std::vector<Design>& designs,
+                                     std::size_t max_shards) {
+  // Groups stems that share a design, which always have the same size, and
+  // distributes the groups over shards, largest groups first.
+  std::array<StemId, stem_id_count> group;
+  for (std::size_t stem = 0; stem < stem_id_count; ++stem)
+    group[stem] = stem;
+  const auto find = [&group](StemId stem) {
+    while (group[stem] != stem)
+      stem = group[stem] = group[group[stem]];
+    return stem;
+  };
+  std::array<std::size_t, stem_id_count> weight{};
+  for (const auto& design : designs) {
+    const auto root = find(design.stem_counts().front().stem.id());
+    for (const auto& option : design.stem_counts())
+      group[find(option.stem.id())] = root;
+  }
+  for (const auto& design : designs)
+    weight[find(design.stem_counts().front().stem.id())] += 1;
+
+  std::array<StemId, stem_id_count> roots;
+  for (std::size_t stem = 0; stem < stem_id_count; ++stem)
+    roots[stem] = stem;
+  std::stable_sort(roots.begin(), roots.end(), [&weight](auto a, auto b) {
+    return weight[a] > weight[b];
+  });
+  const auto groups = std::count_if(weight.begin(), weight.end(),
+                                    [](auto designs) { return designs > 0; });
+  StemPartition partition{std::clamp<std::size_t>(groups, 1, max_shards), {}};
+  std::vector<std::size_t> load(partition.shards);
+  std::array<std::uint8_t, stem_id_count> shard_of_root{};
+  for (const auto root : roots) {
+    if (find(root) != root)
+      continue;
+    const auto lightest = std::min_element(load.begin(), load.end());
+    shard_of_root[root] = lightest - load.begin();
+    *lightest += weight[root];
+  }
+  for (std::size_t stem = 0; stem < stem_id_count; ++stem)
+    partition.shard_of[stem] = shard_of_root[find(stem)];
+  return partition;
+}
+
+class ShardedComposer {
+  // Runs independent Composer shards on their own threads. A reader thread
+  // routes every stem to the shard holding its designs, and the results are
+  // merged back in arrival order by the thread calling run().
+ public:
+  ShardedComposer(const std::vector<Design>& designs, std::size_t threads,
+                  OrderingPolicy policy = OrderingPolicy::move_to_front)
+      : partition(partition_stems(designs, threads)), routes(queue_size) {
+    std::vector<std::vector<Design>> shard_designs(partition.shards);
+    for (const auto& design : designs) {
+      const auto stem = design.stem_counts().front().stem.id();
+      shard_designs[partition.shard_of[stem]].push_back(design);
+    }
+    for (auto& designs : shard_designs)
+      shards.push_back(std::make_unique<Shard>(std::move(designs), policy));
+    for (auto& shard : shards)
+      shard->thread = std::jthread(_compose, std::ref(*shard));
+  }
+
+  template <typename Emit>
+  void run(LineReader& input, Emit emit) {
+    // Reads stems from the input and calls emit() with each formatted bouquet.
+    std::exception_ptr error;
+    std::jthread reader([&] {
+      try {
+        for (std::string_view line; input.readline(line);) {
+          if (is_design_update(line))
+            throw std::invalid_argument("No design updates with --threads");
+          const Stem stem{line};
+          const auto shard = partition.shard_of[stem.id()];
+          shards[shard]->arrivals.push(stem.id());
+          routes.push(shard);
+        }
+      } catch (...) {
+        error = std::current_exception();
+      }
+      for (auto& shard : shards)
+        shard->arrivals.push(end_of_input);
+      routes.push(end_of_input);
+    });
+    for (auto route = routes.pop(); route != end_of_input;) {
+      auto& shard = *shards[route];
+      if (shard.outcomes.pop()) {
+        const auto emission = shard.emissions.pop();
+        emit(std::string_view(emission.text.data(), emission.size));
+      }
+      route = routes.pop();
+    }
+    reader.join();
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  ComposerStats statistics() const noexcept {
+    // Sums the shard statistics, only consistent once run() has returned.
+    ComposerStats stats;
+    for (const auto& shard : shards)
+      stats += shard->composer.statistics();
+    return stats;
+  }
+
+ private:
+  static constexpr std::size_t queue_size = 1 << 14;
+  static constexpr std::uint8_t end_of_input = 0xFF;
+
+  struct Emission {
+    std::size_t size;
+    std::array<char, Bouquet::max_size> text;
+  };
+  struct Shard {
+    Shard(std::vector<Design> designs, OrderingPolicy policy)
+        : composer(designs, policy) {
+      composer.add_designs(designs);
+    }
+
+    Composer composer;
+    SpscQueue<StemId> arrivals{queue_size};
+    SpscQueue<bool> outcomes{queue_size};
+    SpscQueue<Emission> emissions{queue_size / 16};
+    std::jthread thread;
+  };
+
+  StemPartition partition;
+  SpscQueue<std::uint8_t> routes;
+  std::vector<std::unique_ptr<Shard>> shards;
+
+  static void _compose(Shard& shard) {
+    // Shard thread: composes bouquets for its stems until the end of input.
+    for (auto id = shard.arrivals.pop(); id != end_of_input;) {
+      const auto stem = Stem::from_id(id);
+      shard.composer.add_stem(stem);
+      const auto bouquet = shard.composer.bouquet_for_stem(stem);
+      if (bouquet) {
+        Emission emission;
+        emission.size = bouquet->format_to(emission.text.data()) -
+                        emission.text.data();
+        shard.emissions.push(emission);
+      }
+      shard.outcomes.push(bouquet.has_value());
+      id = shard.arrivals.pop();
+    }
+  }
+};
+
+class ComposerServer {
+  // Serves many named composers from one process over a listening socket.
+  // A connection names its composer on the first line and continues in the
+  // composer's input format: a paragraph of designs, then stems and design
+  // updates up to a blank line. Bouquets for its stems, or an error line,
+  // are written back on the connection, which is closed once the client has
+  // closed its end and all output is written. The first connection to a
+  // name creates the composer from its paragraph, later connections send an
+  // empty paragraph to attach to it. Lines are at most max_line bytes, and
+  // the last line may end without a newline at the end of input. An epoll
+  // loop reads all connections and parses catalogs, and each composer is
+  // served by one worker of a pool, which builds it from its catalog and
+  // resolves its lines in order and without locking.
+ public:
+  ComposerServer(std::string_view address, std::size_t workers,
+                 OrderingPolicy policy)
+      : listener(_listen(address)),
+        epoll(epoll_create1(EPOLL_CLOEXEC)),
+        wakeup(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+        policy(policy) {
+    if (epoll < 0 || wakeup < 0)
+      throw std::system_error(errno, std::generic_category(), "epoll");
+    _watch(listener, EPOLLIN, EPOLL_CTL_ADD);
+    _watch(wakeup, EPOLLIN, EPOLL_CTL_ADD);
+    pool.reserve(std::max<std::size_t>(workers, 1));
+    while (pool.size() < pool.capacity())
+      pool.push_back(std::make_unique<Worker>());
+    for (auto& worker : pool)
+      worker->thread = std::jthread([this, &worker = *worker] {
+        _serve(worker);
+      });
+  }
+
+  ~ComposerServer() {
+    for (auto& worker : pool)
+      worker->jobs.push({});
+    pool.clear();
+    for (const auto& [fd, connection] : connections)
+      close(fd);
+    close(wakeup);
+    close(epoll);
+    close(listener);
+  }
+
+  void run() {
+    // Accepts, reads and writes connections until an error occurs.
+    std::array<epoll_event, 64> events;
+    for (;;) {
+      const int count = epoll_wait(epoll, events.data(), events.size(), -1);
+      if (count < 0 && errno != EINTR)
+        throw std::system_error(errno, std::generic_category(), "epoll_wait");
+      for (int index = 0; index < count; ++index) {
+        const int fd = events[index].data.fd;
+        if (fd == listener) {
+          _accept();
+        } else if (fd == wakeup) {
+          _drain_ready();
+        } else if (const auto found = connections.find(fd);
+                   found != connections.end()) {
+          const auto connection = found->second;
+          if (events[index].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            _read(*connection);
+          _flush(connection);
+        }
+      }
+    }
+  }
+
+ private:
+  struct Instance {
+    // The composer is built by its worker, with the first job for it.
+    explicit Instance(std::size_t worker) : worker(worker) {}
+
+    std::optional<Composer> composer;
+    std::size_t worker;
+  };
+
+  struct Connection {
+    // Reading state is used by the event loop only, output is shared with
+    // the worker serving the connection's composer.
+    enum class Phase { name, catalog, stems, discard, done };
+    int fd;
+    std::uint32_t events = EPOLLIN;
+    Phase phase = Phase::name;
+    std::string input;
+    std::string name;
+    std::vector<Design> designs;
+    Instance* instance = nullptr;
+    std::mutex mutex;
+    std::string output;
+    std::size_t pending = 0;
+    bool failed = false;
+  };
+
+  struct Job {
+    std::shared_ptr<Connection> connection;
+    Instance* instance = nullptr;
+    std::vector<Design> designs;
+    std::string lines;
+  };
+
+  struct Worker {
+    SpscQueue<Job> jobs{queue_size};
+    std::jthread thread;
+  };
+
+  static constexpr std::size_t queue_size = 1 << 10;
+  static constexpr std::size_t max_line = 1 << 12;
+  int listener;
+  int epoll;
+  int wakeup;
+  OrderingPolicy policy;
+  std::unordered_map<int, std::shared_ptr<Connection>> connections;
+  std::unordered_map<std::string, std::unique_ptr<Instance>> instances;
+  std::mutex ready_mutex;
+  std::vector<std::shared_ptr<Connection>> ready;
+  std::vector<std::unique_ptr<Worker>> pool;
+
+  static int _listen(std::string_view address) {
+    // Listens on a Unix socket at a path, or on TCP at host:port.
+    const std::string name{address};
+    const auto colon = name.rfind(':');
+    int fd = -1;
+    if (name.find('/') == std::string::npos && colon != std::string::npos) {
+      addrinfo hints{};
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      hints.ai_flags = AI_PASSIVE;
+      const auto host = name.substr(0, colon);
+      const auto port = name.substr(colon + 1);
+      addrinfo* result;
+      if (const int error = getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                                        port.c_str(), &hints, &result)) {
+        auto err_msg = name + ": " + gai_strerror(error);
+        throw std::invalid_argument(err_msg);
+      }
+      fd = socket(result->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  0);
+      const int reuse = 1;
+      if (fd >= 0)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+      if (fd >= 0 && bind(fd, result->ai_addr, result->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+      }
+      freeaddrinfo(result);
+    } else {
+      sockaddr_un socket_address{};
+      socket_address.sun_family = AF_UNIX;
+      if (name.size() >= sizeof(socket_address.sun_path))
+        throw std::invalid_argument("Socket path too long: " + name);
+      std::copy(name.begin(), name.end(), socket_address.sun_path);
+      unlink(name.c_str());
+      fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (fd >= 0 && bind(fd, reinterpret_cast<sockaddr*>(&socket_address),
+                          sizeof(socket_address)) < 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    if (fd < 0 || ::listen(fd, SOMAXCONN) < 0)
+      throw std::system_error(errno, std::generic_category(), name);
+    return fd;
+  }
+
+  void _watch(int fd, std::uint32_t events, int operation) {
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll, operation, fd, &event) < 0)
+      throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+  }
+
+  void _accept() {
+    for (;;) {
+      const int fd = accept4(listener, nullptr, nullptr,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0)
+        return;
+      auto connection = std::make_shared<Connection>();
+      connection->fd = fd;
+      connections.emplace(fd, std::move(connection));
+      _watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+    }
+  }
+
+  void _read(Connection& connection) {
+    // Reads what is available and hands complete stem lines to the worker.
+    std::array<char, 1 << 16> buffer;
+    Job job;
+    bool more = true;
+    const auto accept = [&](std::string_view line) {
+      try {
+        if (line.size() > max_line)
+          throw std::length_error("Line too long");
+        more = _accept_line(connection, line, job);
+      } catch (const std::exception& error) {
+        _fail(connection, error.what());
+        more = false;
+      }
+    };
+    while (more && connection.phase != Connection::Phase::done) {
+      const auto bytes = ::read(connection.fd, buffer.data(), buffer.size());
+      if (bytes < 0 && (errno == EAGAIN || errno == EINTR))
+        break;
+      if (bytes <= 0) {
+        if (bytes == 0 && !connection.input.empty() &&
+            connection.phase != Connection::Phase::discard)
+          accept(connection.input);
+        connection.input.clear();
+        connection.phase = Connection::Phase::done;
+        break;
+      }
+      if (connection.phase == Connection::Phase::discard)
+        continue;
+      connection.input.append(buffer.data(), bytes);
+      std::size_t start = 0;
+      for (std::size_t newline;
+           more && (newline = connection.input.find('\n', start)) !=
+                       std::string::npos;
+           start = newline + 1)
+        accept({connection.input.data() + start, newline - start});
+      connection.input.erase(0, start);
+      if (more && connection.input.size() > max_line)
+        accept(connection.input);
+      if (!more)
+        connection.input.clear();
+    }
+    if (job.lines.empty() && job.designs.empty())
+      return;
+    {
+      const std::lock_guard guard{connection.mutex};
+      ++connection.pending;
+    }
+    job.connection = connections.at(connection.fd);
+    job.instance = connection.instance;
+    pool[connection.instance->worker]->jobs.push(std::move(job));
+  }
+
+  bool _accept_line(Connection& connection, std::string_view line, Job& job) {
+    // Processes a line of the connection into the job for its composer, and
+    // returns whether to read more.
+    using Phase = Connection::Phase;
+    if (connection.phase == Phase::name) {
+      if (line.empty())
+        throw std::invalid_argument("Missing composer name");
+      connection.name = line;
+      connection.phase = Phase::catalog;
+    } else if (connection.phase == Phase::catalog && !line.empty()) {
+      connection.designs.emplace_back(line);
+    } else if (connection.phase == Phase::catalog) {
+      auto found = instances.find(connection.name);
+      if (found != instances.end() && !connection.designs.empty()) {
+        auto err_msg = "Composer already has a catalog: " + connection.name;
+        throw std::invalid_argument(err_msg);
+      }
+      if (found == instances.end() && connection.designs.empty()) {
+        auto err_msg = "No catalog for new composer: " + connection.name;
+        throw std::invalid_argument(err_msg);
+      }
+      if (found == instances.end()) {
+        const auto worker = instances.size() % pool.size();
+        auto instance = std::make_unique<Instance>(worker);
+        found = instances.emplace(connection.name, std::move(instance)).first;
+        job.designs = std::move(connection.designs);
+      }
+      connection.instance = found->second.get();
+      connection.phase = Phase::stems;
+    } else if (!line.empty()) {
+      job.lines.append(line).push_back('\n');
+    } else {
+      connection.phase = Phase::discard;
+    }
+    return connection.phase != Phase::discard;
+  }
+
+  void _fail(Connection& connection, std::string_view message) {
+    const std::lock_guard guard{connection.mutex};
+    connection.output.append("error: ").append(message).push_back('\n');
+    connection.failed = true;
+    connection.phase = Connection::Phase::discard;
+  }
+
+  void _serve(Worker& worker) {
+    // Resolves the stems of jobs for the composers served by this worker.
+    for (auto job = worker.jobs.pop(); job.connection;
+         job = worker.jobs.pop()) {
+      auto& connection = *job.connection;
+      auto& instance = *job.instance;
+      std::string output;
+      std::optional<std::string> error;
+      {
+        const std::lock_guard guard{connection.mutex};
+        if (connection.failed)
+          job.lines.clear();
+      }
+      std::string_view lines{job.lines};
+      try {
+        if (!job.designs.empty()) {
+          instance.composer.emplace(job.designs, policy);
+          instance.composer->add_designs(job.designs);
+        }
+        if (!instance.composer)
+          throw std::runtime_error("Composer has no catalog");
+        auto& composer = *instance.composer;
+        for (std::size_t newline; (newline = lines.find('\n')) !=
+                                  std::string_view::npos;
+             lines.remove_prefix(newline + 1)) {
+          const auto line = lines.substr(0, newline);
+          if (is_design_update(line)) {
+            apply_design_update(composer, line);
+            continue;
+          }
+          const Stem stem{line};
+          composer.add_stem(stem);
+          if (auto bouquet = composer.bouquet_for_stem(stem)) {
+            std::array<char, Bouquet::max_size> formatted;
+            const auto end = bouquet->format_to(formatted.data());
+            output.append(formatted.data(), end);
+            output.push_back('\n');
+          }
+        }
+      } catch (const std::exception& exception) {
+        error = exception.what();
+      }
+      {
+        const std::lock_guard guard{connection.mutex};
+        connection.output += output;
+        if (error && !connection.failed)
+          connection.output.append("error: ").append(*error).push_back('\n');
+        connection.failed |= error.has_value();
+        --connection.pending;
+      }
+      {
+        const std::lock_guard guard{ready_mutex};
+        ready.push_back(std::move(job.connection));
+      }
+      const std::uint64_t signal = 1;
+      [[maybe_unused]] auto written = ::write(wakeup, &signal, sizeof(signal));
+    }
+  }
+
+  void _drain_ready() {
+    std::uint64_t signals;
+    [[maybe_unused]] auto bytes = ::read(wakeup, &signals, sizeof(signals));
+    std::vector<std::shared_ptr<Connection>> batch;
+    {
+      const std::lock_guard guard{ready_mutex};
+      batch.swap(ready);
+    }
+    for (const auto& connection : batch)
+      _flush(connection);
+  }
+
+  void _flush(const std::shared_ptr<Connection>& connection) {
+    // Writes pending output, and closes the connection once it is done.
+    const auto found = connections.find(connection->fd);
+    if (found == connections.end() || found->second != connection)
+      return;
+    bool finished;
+    bool waiting;
+    {
+      const std::lock_guard guard{connection->mutex};
+      while (!connection->output.empty()) {
+        const auto bytes =
+            send(connection->fd, connection->output.data(),
+                 connection->output.size(), MSG_NOSIGNAL);
+        if (bytes < 0 && errno == EINTR)
+          continue;
+        if (bytes < 0 && errno != EAGAIN) {
+          connection->output.clear();
+          connection->failed = true;
+          connection->phase = Connection::Phase::done;
+        }
+        if (bytes < 0)
+          break;
+        connection->output.erase(0, bytes);
+      }
+      waiting = !connection->output.empty();
+      finished = connection->phase == Connection::Phase::done &&
+                 connection->pending == 0 && !waiting;
+    }
+    if (finished) {
+      epoll_ctl(epoll, EPOLL_CTL_DEL, connection->fd, nullptr);
+      close(connection->fd);
+      connections.erase(connection->fd);
+      return;
+    }
+    const std::uint32_t events =
+        (connection->phase != Connection::Phase::done ? EPOLLIN : 0) |
+        (waiting ? EPOLLOUT : 0);
+    if (events != connection->events) {
+      connection->events = events;
+      _watch(connection->fd, events, EPOLL_CTL_MOD);
+    }
+  }
+};
@@ -0,0 +1,166 @@
+#!/usr/bin/env bash
+# Differential fuzz test: runs the reference composer and each optimized
+# variant on random catalogs and stem streams, diffs their output and reports
+# each variant's speedup over the reference, as total time over the cases it
+# ran. Variants under other ordering policies are diffed against the
+# per-stem composer under the same policy. Speedups below 1 are flagged, and
+# below FUZZ_MIN_SPEEDUP (default 0.25) they fail. The first FUZZ_STATIC_CASES
+# cases (default 1) also build and run a composer with the catalog compiled
+# in, which takes a while for large catalogs. On CPUs with AVX2, a composer
+# built for it covers the vector path of cap_options().
+#
+# Usage: ./fuzz.sh [cases] [first seed]
+set -euo pipefail
+
+cases=${1:-20}
+seed=${2:-1}
+min_speedup=${FUZZ_MIN_SPEEDUP:-0.25}
+static_cases=${FUZZ_STATIC_CASES:-1}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+variants=(
+  "./composer"
+  "./composer --batch 64"
+  "./composer --batch 64 --batch-order optimized --optimize-budget-us 0"
+  "./composer --async"
+  "./composer --threads 2"
+  "./composer --catalog $work/catalog.img"
+  "./composer --binary"
+  "./composer-stats"
+  "$work/composer-static"
+  "$work/composer-avx2"
+)
+policies=(frequency most-constrained static)
+policy_variants=(
+  "--batch 64"
+  "--batch 64 --batch-order optimized --optimize-budget-us 0"
+  "--catalog $work/catalog.img"
+  "--threads 2"
+)
+for policy in "${policies[@]}"; do
+  variants+=("./composer --policy $policy")
+  for options in "${policy_variants[@]}"; do
+    variants+=("./composer --policy $policy $options")
+  done
+done
+declare -A elapsed reference_elapsed
+failures=0
+
+if grep -qw avx2 /proc/cpuinfo 2>/dev/null; then
+  clang++ -O3 -Wall --std=c++20 -pthread -mavx2 composer.cpp \
+    -o "$work/composer-avx2"
+fi
+
+run() {
+  # Runs a composer on the case input, leaving its output and elapsed time.
+  local output=$1 input=$2
+  shift 2
+  local start=$(date +%s%N)
+  "$@" < "$input" > "$output"
+  echo $(($(date +%s%N) - start))
+}
+
+to_binary() {
+  # Writes text stems as binary stem ids of one byte each.
+  LC_ALL=C awk 'BEGIN {
+    for (i = 0; i < 26; ++i) {
+      id[sprintf("%cS", 97 + i)] = i
+      id[sprintf("%cL", 97 + i)] = 26 + i
+    }
+  } { printf "%c", id[$0] }'
+}
+
+from_binary() {
+  # Formats binary bouquet records as text, with design codes from a catalog.
+  # Records are read in little-endian byte order.
+  od -An -v -tu1 | awk -v catalog="$1" '
+  function u32(at,    value, i) {
+    for (i = 3; i >= 0; --i)
+      value = value * 256 + byte[at + i]
+    return value
+  }
+  BEGIN {
+    while ((getline line < catalog) > 0 && line != "")
+      code[designs++] = substr(line, 1, 2)
+  }
+  { for (i = 1; i <= NF; ++i) byte[bytes++] = $i }
+  END {
+    for (at = 0; at < bytes;) {
+      bouquet = code[u32(at)]
+      species = byte[at + 4]
+      for (at += 5; species-- > 0; at += 5)
+        bouquet = bouquet u32(at + 1) sprintf("%c", 97 + byte[at])
+      print bouquet
+    }
+  }'
+}
+
+for ((index = 0; index < cases; ++index, ++seed)); do
+  RANDOM=$seed
+  distributions=(uniform zipf)
+  workload=(--seed "$seed" --species $((RANDOM % 26 + 1))
+            --sizes $((RANDOM % 2 + 1)) --designs $((RANDOM % 2000 + 1))
+            --options $((RANDOM % 8 + 1)) --max-count $((RANDOM % 8 + 1))
+            --stems $((RANDOM % 100000 + 1000))
+            --distribution "${distributions[RANDOM % 2]}")
+  ./composer-bench --emit "${workload[@]}" > "$work/input"
+  sed '/^$/q' "$work/input" > "$work/catalog"
+  ./composer --compile-catalog "$work/catalog.img" < "$work/catalog"
+  sed '1,/^$/d' "$work/input" > "$work/stems"
+  { cat "$work/catalog"; to_binary < "$work/stems"; } > "$work/input.bin"
+  rm -f "$work/composer-static"
+  if ((index < static_cases)); then
+    ./composer --emit-catalog < "$work/catalog" > "$work/catalog.hpp"
+    clang++ -O3 -Wall --std=c++20 -pthread \
+      -DCOMPOSER_CATALOG="\"$work/catalog.hpp\"" composer.cpp \
+      -o "$work/composer-static"
+  fi
+
+  reference_time=$(run "$work/expected" "$work/input" ./composer-reference)
+  for variant in "${variants[@]}"; do
+    input="$work/input"
+    [[ $variant == *--catalog* || $variant == *composer-static ]] &&
+      input="$work/stems"
+    [[ $variant == *--binary* ]] && input="$work/input.bin"
+    [[ -x ${variant%% *} ]] || continue
+    expected="$work/expected"
+    if [[ $variant == *--policy* ]]; then
+      policy=${variant#*--policy }
+      policy=${policy%% *}
+      expected="$work/expected-$policy"
+      [[ $variant == "./composer --policy $policy" ]] && expected=/dev/null
+    fi
+    variant_time=$(run "$work/actual" "$input" $variant)
+    elapsed[$variant]=$((${elapsed[$variant]:-0} + variant_time))
+    reference_elapsed[$variant]=$((${reference_elapsed[$variant]:-0} +
+                                   reference_time))
+    if [[ $variant == *--binary* ]]; then
+      from_binary "$work/catalog" < "$work/actual" > "$work/actual.txt"
+      mv "$work/actual.txt" "$work/actual"
+    fi
+    if [[ $expected == /dev/null ]]; then
+      mv "$work/actual" "$work/expected-$policy"
+    elif ! cmp -s "$expected" "$work/actual"; then
+      echo "FAIL: ${variant//$work/...} differs for ${workload[*]}"
+      failures=$((failures + 1))
+    fi
+  done
+done
+
+echo "cases $cases, failures $failures"
+for variant in "${variants[@]}"; do
+  [[ -n ${elapsed[$variant]:-} ]] || continue
+  speedup=$(awk -v ref="${reference_elapsed[$variant]}" \
+            -v var="${elapsed[$variant]}" 'BEGIN { printf "%.2f", ref / var }')
+  flag=""
+  if awk -v speedup="$speedup" -v min="$min_speedup" \
+       'BEGIN { exit !(speedup < min) }'; then
+    flag="  FAIL: below $min_speedup"
+    failures=$((failures + 1))
+  elif awk -v speedup="$speedup" 'BEGIN { exit !(speedup < 1) }'; then
+    flag="  slower than the reference"
+  fi
+  printf '%6sx  %s%s\n' "$speedup" "${variant//$work/...}" "$flag"
+done
+[[ $failures -eq 0 ]]